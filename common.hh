@@ -3,6 +3,8 @@
 #endif
 #include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
+#include <bitset>
 #include <cassert>
 #include <cctype>
 #include <climits>
@@ -11,6 +13,7 @@
 #include <memory>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <dirent.h>
 #include <errno.h>
 #include <execinfo.h>
@@ -19,20 +22,29 @@
 #include <getopt.h>
 #include <cinttypes>
 #include <map>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
 #include <pthread.h>
+#include <queue>
 #include <set>
 #include <setjmp.h>
 #include <signal.h>
 #include <stack>
 #include <stdarg.h>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sysexits.h>
 #include <tuple>
@@ -40,6 +52,7 @@
 #include <unistd.h>
 #include <utility>
 #include <vector>
+#include <zlib.h>
 using namespace std;
 
 typedef uint8_t u8;
@@ -217,6 +230,39 @@ double get_double(const char *arg)
   return ret;
 }
 
+// a CPU list such as `0-3,8`
+vector<int> get_cpus(const char *arg)
+{
+  vector<int> ret;
+  for (const char *p = arg; *p; ) {
+    char *end;
+    errno = 0;
+    long lo = strtol(p, &end, 10), hi = lo;
+    if (*end == '-')
+      hi = strtol(end+1, &end, 10);
+    if (errno || end == p || lo < 0 || hi < lo || hi >= CPU_SETSIZE || (*end && *end != ','))
+      err_exit(EX_USAGE, "get_cpus: %s", arg);
+    FOR(i, lo, hi+1)
+      ret.push_back(i);
+    p = *end ? end+1 : end;
+  }
+  return ret;
+}
+
+double thread_cpu_time()
+{
+  timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+double monotonic_time()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
 class StopWatch
 {
   timeval start_;
@@ -229,158 +275,1201 @@ public:
   }
 };
 
-template<class Key, class Val>
-struct RefCountTreap {
-  ~RefCountTreap() { clear(); }
-
-  struct Node {
-    Key key;
-    Val val;
-    Node* c[2] = {};
-    int refcnt = 1, pri;
-    Node(const Key& key, const Val& val) : key(key), val(val), pri(rand()) {}
-    Node(const Node& x) : key(x.key), val(x.val), c{x.c[0], x.c[1]}, pri(x.pri) {
-      if (c[0]) c[0]->refcnt++;
-      if (c[1]) c[1]->refcnt++;
-    }
-    void unref() { if (! --refcnt) delete this; }
-    ~Node() {
-      if (c[0]) c[0]->unref();
-      if (c[1]) c[1]->unref();
+// lines of `str`, without the newlines
+vector<string> split_lines(size_t n, const char *str)
+{
+  vector<string> ret;
+  for (const char *end = str+n; ; ) {
+    const char *nl = (const char *)memchr(str, '\n', end-str);
+    ret.emplace_back(str, nl ? nl : end);
+    if (! nl) break;
+    str = nl+1;
+  }
+  return ret;
+}
+
+ssize_t write_all(int fd, const void* buf, size_t count)
+{
+  auto* a = (const u8*)buf;
+  ssize_t r;
+  while (count > 0) {
+    r = write(fd, a, count);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
     }
-  } *root = nullptr;
-  static vector<Node*> roots;
+    a += r;
+    count -= r;
+  }
+  return count;
+}
 
-  void clear() {
-    if (root) {
-      root->unref();
-      root = nullptr;
+// writes all of iov[0..n), resuming after partial writes; modifies iov
+ssize_t writev_all(int fd, iovec* iov, long n)
+{
+  while (n > 0) {
+    ssize_t r = writev(fd, iov, min(n, long(IOV_MAX)));
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    for (; n > 0 && size_t(r) >= iov->iov_len; n--)
+      r -= iov++->iov_len;
+    if (n > 0) {
+      iov->iov_base = (u8*)iov->iov_base+r;
+      iov->iov_len -= r;
     }
   }
+  return 0;
+}
 
-  Node* find(const Key& key) {
-    return find(root, key);
+// reads until EOF; false on error, on `timeout` seconds of inactivity, or if the request exceeds `limit` bytes
+bool read_request(int fd, double timeout, long limit, string &req)
+{
+  timespec ts;
+  {
+    double tmp;
+    ts.tv_nsec = modf(timeout, &tmp)*1e9;
+    ts.tv_sec = tmp;
   }
-  Node* find(Node* x, const Key& key) {
-    while (x) {
-      if (key < x->key) x = x->c[0];
-      else if (key > x->key) x = x->c[1];
-      else break;
+  struct pollfd fds;
+  fds.fd = fd;
+  fds.events = POLLIN;
+  for(;;) {
+    int ready = ppoll(&fds, 1, &ts, NULL);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      return false;
     }
-    return x;
+    if (! ready) return false; // timeout
+    char chunk[BUF_SIZE];
+    ssize_t t = read(fd, chunk, sizeof chunk);
+    if (t < 0) return false;
+    if (! t) return true;
+    if (req.size()+t > limit) return false;
+    req.append(chunk, t);
   }
+}
 
-  void insert(const Key& key, const Val& val) {
-    roots.push_back(root);
-    if (root) root->refcnt++;
-    insert(root, key, val);
+// collects output and writes it in large chunks; with a negative fd, all output is kept in `buf`
+class BufferedWriter
+{
+  int fd_;
+  bool ok_ = true;
+public:
+  string buf;
+  explicit BufferedWriter(int fd) : fd_(fd) {}
+  ~BufferedWriter() { flush(); }
+  // false once a write has failed
+  bool flush() {
+    if (fd_ < 0) return ok_;
+    if (ok_ && buf.size() && write_all(fd_, buf.data(), buf.size()) < 0)
+      ok_ = false;
+    buf.clear();
+    return ok_;
   }
-  void insert(Node*& x, const Key& key, const Val& val) {
-    if (! x)
-      x = new Node(key, val);
+  bool maybe_flush() { return buf.size() < 1 << 16 || flush(); }
+
+  bool printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+    va_list ap, ap2;
+    va_start(ap, format);
+    va_copy(ap2, ap);
+    char tmp[BUF_SIZE];
+    int n = vsnprintf(tmp, sizeof tmp, format, ap);
+    if (n < int(sizeof tmp))
+      buf.append(tmp, n);
     else {
-      Node* y = x;
-      x = new Node(*x);
-      y->unref();
-      long d = x->key < key;
-      insert(x->c[d], key, val);
-      if (x->c[d]->pri < x->pri)
-        zag(x, d);
+      size_t old = buf.size();
+      buf.resize(old+n+1);
+      vsnprintf(&buf[old], n+1, format, ap2);
+      buf.resize(old+n);
     }
+    va_end(ap2);
+    va_end(ap);
+    return maybe_flush();
   }
+};
 
-  void erase(const Key& key) {
-    roots.push_back(root);
-    if (root) root->refcnt++;
-    erase(root, key);
-  }
-  void erase(Node*& x, const Key& key) {
-    if (! x) return;
-    Node* y = x;
-    if (key < x->key)
-      x = new Node(*x), y->unref(), erase(x->c[0], key);
-    else if (key > x->key)
-      x = new Node(*x), y->unref(), erase(x->c[1], key);
-    else if (! x->c[0])
-      x = x->c[1], y->unref(), x && x->refcnt++;
-    else if (! x->c[1])
-      x = x->c[0], y->unref(), x && x->refcnt++;
-    else if (x->c[0]->key == key)
-      x = new Node(*x), y->unref(), erase(x->c[0], key);
-    else if (x->c[1]->key == key)
-      x = new Node(*x), y->unref(), erase(x->c[1], key);
-    else {
-      x = new Node(*x);
-      y->unref();
-      long d = x->c[0]->pri < x->c[1]->pri;
-      x->c[d]->unref();
-      x->c[d] = new Node(*x->c[d]);
-      zag(x, d);
-      erase(x->c[d^1], key);
+// set once the client of a request has gone away; long-running work checks it and gives up
+// a legacy client half-closes after its request (POLLRDHUP), so only a full close (POLLHUP) or an error of `fd` counts as a hang-up.
+// Over TCP, a full close after the half-close sends nothing, so it stays unseen until a response write draws a reset: a TCP client
+// abandoning a request hangs up with close_reset
+struct CancelToken
+{
+  int fd;
+  atomic<bool> cancelled{false};
+  explicit CancelToken(int fd = -1) : fd(fd) {}
+  bool check() {
+    if (! cancelled && fd >= 0) {
+      struct pollfd p = {fd, POLLRDHUP, 0};
+      if (poll(&p, 1, 0) > 0 && p.revents & (POLLHUP | POLLERR))
+        cancelled = true;
     }
+    return cancelled;
+  }
+};
+
+template<class F>
+struct ParallelFor {
+  F &f;
+  long n;
+  atomic<long> next;
+  ParallelFor(F &f, long n) : f(f), n(n), next(0) {}
+  static void* run(void *arg) {
+    auto self = (ParallelFor*)arg;
+    for (long i; (i = self->next++) < self->n; )
+      self->f(i);
+    return NULL;
+  }
+};
+
+// call f(0), ..., f(n-1) on up to `threads` threads, the calling thread included
+template<class F>
+void parallel_for(long n, long threads, F f)
+{
+  ParallelFor<F> ctx(f, n);
+  vector<pthread_t> tids;
+  REP(i, min(threads, n)-1) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, ParallelFor<F>::run, &ctx)) {
+      err_msg("pthread_create");
+      break;
+    }
+    tids.push_back(tid);
+  }
+  ParallelFor<F>::run(&ctx);
+  for (auto tid: tids)
+    pthread_join(tid, NULL);
+}
+
+// a fixed number of threads serving accepted connections, pinned round-robin to `cpus` (by default, the CPUs the process may run on)
+// backpressure: while `queue_limit` connections are waiting, the caller stops accepting and further clients wait in the listen backlog; a
+// connection that has waited for more than `queue_timeout` seconds is closed unserved, by which time its client has likely given up
+// lanes: jobs may be pushed to further lanes, each running at most `quota` jobs at once; a free thread takes the oldest job of the first
+// lane with work and room, and a job pushed to a lane already holding `queue_limit` jobs is shed (run at once as late)
+class WorkerPool
+{
+  struct Lane {
+    deque<pair<function<void(bool, double)>, double>> queue; // job taking whether it is late and the time it was queued, that time
+    long quota, running = 0;
+    ulong queue_limit;
+  };
+  void (*serve_)(int, double);
+  double queue_timeout_;
+  vector<Lane> lanes_;
+  vector<pthread_t> tids_;
+  int wake_fd_ = -1;
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+  pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER, room_ = PTHREAD_COND_INITIALIZER;
+  bool quit_ = false;
+
+  // with `mutex_` held
+  Lane* next_lane() {
+    for (auto& lane: lanes_)
+      if (lane.queue.size() && lane.running < lane.quota)
+        return &lane;
+    return nullptr;
   }
-  void zag(Node*& x, long d) {
-    Node* y = x->c[d];
-    x->c[d] = y->c[d^1];
-    y->c[d^1] = x;
-    x = y;
-  }
-
-  struct Backward {
-    Node* x;
-    vector<Node*> st;
-    void weave() {
-      for (; x; x = x->c[1])
-        st.push_back(x);
-      if (st.size()) {
-        x = st.back();
-        st.pop_back();
+
+  static void* run(void *arg) {
+    auto self = (WorkerPool*)arg;
+    pthread_mutex_lock(&self->mutex_);
+    for(;;) {
+      Lane* lane;
+      while (! (lane = self->next_lane()) && ! self->quit_)
+        pthread_cond_wait(&self->cond_, &self->mutex_);
+      if (! lane) break;
+      if (lane == &self->lanes_[0] && lane->queue.size() == lane->queue_limit) {
+        u64 one = 1;
+        if (write(self->wake_fd_, &one, sizeof one) < 0)
+          err_msg("write");
+        pthread_cond_broadcast(&self->room_);
       }
+      auto x = move(lane->queue.front());
+      lane->queue.pop_front();
+      lane->running++;
+      bool late = monotonic_time()-x.second > self->queue_timeout_;
+      if (late)
+        self->expired++;
+      pthread_mutex_unlock(&self->mutex_);
+      x.first(late, x.second);
+      pthread_mutex_lock(&self->mutex_);
+      lane->running--;
+      if (self->next_lane())
+        pthread_cond_signal(&self->cond_);
     }
-    Backward begin() {
-      weave();
-      return *this;
+    pthread_mutex_unlock(&self->mutex_);
+    return NULL;
+  }
+public:
+  atomic<long> expired{0}, shed{0};
+
+  ~WorkerPool() {
+    if (wake_fd_ >= 0)
+      close(wake_fd_);
+  }
+
+  void init(long threads, long queue_limit, double queue_timeout, void (*serve)(int, double), vector<int> cpus = {}) {
+    serve_ = serve;
+    queue_timeout_ = queue_timeout;
+    add_lane(threads, max(queue_limit, 1L));
+    if ((wake_fd_ = eventfd(0, EFD_NONBLOCK)) < 0)
+      err_exit(EX_OSERR, "eventfd");
+    cpu_set_t allowed;
+    if (cpus.empty() && ! sched_getaffinity(0, sizeof allowed, &allowed))
+      REP(i, CPU_SETSIZE)
+        if (CPU_ISSET(i, &allowed))
+          cpus.push_back(i);
+    REP(i, threads) {
+      pthread_t tid;
+      if (pthread_create(&tid, NULL, run, this))
+        err_exit(EX_OSERR, "pthread_create");
+      if (cpus.size()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i%cpus.size()], &set);
+        pthread_setaffinity_np(tid, sizeof set, &set);
+      }
+      tids_.push_back(tid);
     }
-    Backward end() { return Backward{nullptr}; }
-    bool operator!=(const Backward& o) { return x != o.x; }
-    Backward operator++() { x = x->c[0]; weave(); return *this; }
-    Node& operator*() { return *x; }
-  };
+  }
+
+  // lane 0 is created by `init` and takes connections; call before pushing to the new lane
+  long add_lane(long quota, long queue_limit) {
+    pthread_mutex_lock(&mutex_);
+    lanes_.emplace_back();
+    lanes_.back().quota = max(quota, 1L);
+    lanes_.back().queue_limit = max(queue_limit, 1L);
+    long ret = lanes_.size()-1;
+    pthread_mutex_unlock(&mutex_);
+    return ret;
+  }
+
+  // readable once a full queue has room again; poll it, then call `woken`
+  int wake_fd() const { return wake_fd_; }
+  void woken() {
+    u64 x;
+    while (read(wake_fd_, &x, sizeof x) > 0);
+  }
 
-  Backward backward(Node* x) { return Backward{x}; }
+  // lane 0 has reached its queue limit
+  bool full() {
+    pthread_mutex_lock(&mutex_);
+    bool ret = lanes_[0].queue.size() >= lanes_[0].queue_limit;
+    pthread_mutex_unlock(&mutex_);
+    return ret;
+  }
+
+  // blocks while lane 0 is full; false once the pool stops
+  bool wait_room() {
+    pthread_mutex_lock(&mutex_);
+    while (! quit_ && lanes_[0].queue.size() >= lanes_[0].queue_limit)
+      pthread_cond_wait(&room_, &mutex_);
+    bool ret = ! quit_;
+    pthread_mutex_unlock(&mutex_);
+    return ret;
+  }
+
+  // `job(late, queued)` runs on a worker; `late` is set if it waited longer than the queue timeout or was shed, `queued` is the
+  // monotonic time of the push
+  void push(function<void(bool, double)> job, long lane = 0) {
+    double now = monotonic_time();
+    pthread_mutex_lock(&mutex_);
+    auto& l = lanes_[lane];
+    if (lane && l.queue.size() >= l.queue_limit) {
+      shed++;
+      pthread_mutex_unlock(&mutex_);
+      job(true, now);
+      return;
+    }
+    l.queue.emplace_back(move(job), now);
+    if (l.running < l.quota)
+      pthread_cond_signal(&cond_);
+    pthread_mutex_unlock(&mutex_);
+  }
 
-  struct RangeBackward {
-    Node* x;
-    Key l, h, min, max;
-    vector<tuple<Node*, Key, Key>> st;
-    void step() {
-      if ((h = x->key) < min)
-        x = nullptr;
+  void push(int connfd) {
+    auto serve = serve_;
+    push([=](bool late, double queued) {
+      if (late)
+        close(connfd);
       else
-        x = x->c[0];
+        serve(connfd, queued);
+    });
+  }
+
+  // serves the queued connections, then joins the threads
+  void stop() {
+    pthread_mutex_lock(&mutex_);
+    quit_ = true;
+    pthread_cond_broadcast(&cond_);
+    pthread_cond_broadcast(&room_);
+    pthread_mutex_unlock(&mutex_);
+    for (auto tid: tids_)
+      pthread_join(tid, NULL);
+    tids_.clear();
+  }
+};
+
+// resolves `[host:]port`, where host defaults to loopback and IPv6 hosts go in brackets; a getaddrinfo error code
+int resolve(const string& spec, int flags, addrinfo **res)
+{
+  string host = "127.0.0.1", port = spec;
+  size_t colon = spec.rfind(':');
+  if (spec.size() && spec[0] == '[' && colon != string::npos && spec[colon-1] == ']') {
+    host = spec.substr(1, colon-2);
+    port = spec.substr(colon+1);
+  } else if (colon != string::npos) {
+    host = spec.substr(0, colon);
+    port = spec.substr(colon+1);
+  }
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags | AI_NUMERICSERV;
+  return getaddrinfo(host.c_str(), port.c_str(), &hints, res);
+}
+
+// a nonblocking socket connecting to a Unix domain socket path (starting with `/`) or to `[host:]port` over TCP; -1 on failure
+// a TCP connection may still be in progress: wait for POLLOUT
+int dial(const string& addr)
+{
+  int fd = -1;
+  if (addr.size() && addr[0] == '/') {
+    struct sockaddr_un sun = {};
+    sun.sun_family = AF_UNIX;
+    strncpy(sun.sun_path, addr.c_str(), sizeof(sun.sun_path)-1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0 &&
+        connect(fd, (struct sockaddr *)&sun, sizeof sun) < 0) { // EAGAIN: the backlog is full
+      close(fd);
+      fd = -1;
+    }
+    return fd;
+  }
+  addrinfo *res;
+  if (resolve(addr, 0, &res))
+    return -1;
+  if ((fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) >= 0) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  freeaddrinfo(res);
+  return fd;
+}
+
+// closes a connection with a reset rather than a FIN, which a peer sees as a hang-up even after this side has half-closed
+void close_reset(int fd)
+{
+  struct linger l = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof l);
+  close(fd);
+}
+
+// Accepts TCP connections on `[host:]port` (host defaults to loopback, IPv6 hosts go in brackets) for a WorkerPool. Each of
+// `acceptors` threads runs its own accept loop on its own listening socket, bound to the same address with SO_REUSEPORT, so the kernel
+// spreads incoming connections over them. While lane 0 of the pool is full, the acceptors stop accepting and clients wait in the
+// listen backlog. Connections get TCP_NODELAY, and keepalive probes to notice peers that vanished.
+class TcpListener
+{
+  WorkerPool *pool_ = nullptr;
+  vector<int> fds_;
+  vector<pthread_t> tids_;
+  struct Acceptor {
+    TcpListener *self;
+    int fd;
+  };
+
+  static void* run(void *arg) {
+    auto a = (Acceptor*)arg;
+    while (a->self->pool_->wait_room()) {
+      int connfd = accept4(a->fd, NULL, NULL, SOCK_CLOEXEC);
+      if (connfd < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE) {
+          if (errno == EMFILE || errno == ENFILE) {
+            err_msg("accept4");
+            usleep(100000);
+          }
+          continue;
+        }
+        break; // shut down by `stop`
+      }
+      int one = 1, idle = 60, interval = 10, count = 5;
+      setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+      setsockopt(connfd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one);
+      setsockopt(connfd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof idle);
+      setsockopt(connfd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof interval);
+      setsockopt(connfd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof count);
+      a->self->pool_->push(connfd);
+    }
+    delete a;
+    return NULL;
+  }
+
+public:
+  ~TcpListener() { stop(); }
+
+  void init(const char *spec, long acceptors, WorkerPool& pool) {
+    pool_ = &pool;
+    addrinfo *res;
+    if (int e = resolve(spec, AI_PASSIVE, &res))
+      err_exit(EX_USAGE, "getaddrinfo %s: %s", spec, gai_strerror(e));
+    REP(i, max(acceptors, 1L)) {
+      int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0), one = 1;
+      if (fd < 0)
+        err_exit(EX_OSERR, "socket");
+      if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one) < 0 ||
+          setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0)
+        err_exit(EX_OSERR, "setsockopt");
+      if (bind(fd, res->ai_addr, res->ai_addrlen) < 0)
+        err_exit(EX_OSERR, "bind %s", spec);
+      if (listen(fd, SOMAXCONN) < 0)
+        err_exit(EX_OSERR, "listen");
+      fds_.push_back(fd);
+      pthread_t tid;
+      if (pthread_create(&tid, NULL, run, new Acceptor{this, fd}))
+        err_exit(EX_OSERR, "pthread_create");
+      tids_.push_back(tid);
+    }
+    freeaddrinfo(res);
+  }
+
+  // call before stopping the pool
+  void stop() {
+    for (int fd: fds_)
+      shutdown(fd, SHUT_RDWR); // wakes up a blocked accept
+    for (auto tid: tids_)
+      pthread_join(tid, NULL);
+    for (int fd: fds_)
+      close(fd);
+    fds_.clear();
+    tids_.clear();
+  }
+};
+
+// Persistent connections carrying length-prefixed frames. A request frame is a
+// little-endian u32 id, u32 length and that many bytes of a legacy request; it is
+// answered by a frame with the same id, the response length, a status byte
+// (FRAME_SERVED, or FRAME_SHED if it waited too long in the pool or its lane was
+// full) and the response. Up to `inflight_limit` requests per connection run
+// concurrently, so responses may come back out of order. With `classify`, a
+// request runs in the pool lane it returns. Requests still running when their
+// connection hangs up are cancelled. Call `process` when `fd` is readable.
+enum { FRAME_SERVED = 0, FRAME_SHED = 1 };
+
+class FrameServer
+{
+  struct Conn {
+    int fd;
+    string in;
+    deque<string> out; // frame headers and responses, sent with one sendmsg per batch
+    size_t in_pos = 0, out_pos = 0;
+    long inflight = 0;
+    bool eof = false, dead = false, closed = false, held = false; // held: a complete frame waits for room
+    CancelToken cancel; // set when the peer hangs up (a half close only ends its requests) or the connection fails
+    explicit Conn(int fd) : fd(fd) {}
+  };
+  WorkerPool *pool_ = nullptr;
+  function<void(string&, BufferedWriter&, CancelToken&, double)> handle_; // request, response, cancellation, time it was queued
+  function<long(const string&)> classify_;
+  long size_limit_, inflight_limit_;
+  int sockfd_ = -1, epfd_ = -1, done_fd_ = -1;
+  map<int, shared_ptr<Conn>> conns_;
+  vector<shared_ptr<Conn>> done_; // connections with new responses, guarded by `mutex_`
+  pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+
+  static void put_u32(string& s, u32 x) {
+    REP(i, 4)
+      s += char(x >> i*8);
+  }
+  static u32 get_u32(const char *p) {
+    u32 x = 0;
+    REP(i, 4)
+      x |= u32(u8(p[i])) << i*8;
+    return x;
+  }
+
+  void watch(int fd, u32 events) {
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+      err_exit(EX_OSERR, "epoll_ctl");
+  }
+
+  void accept_all() {
+    for(;;) {
+      int fd = accept4(sockfd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+          err_msg("accept4");
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        break;
+      }
+      conns_[fd] = make_shared<Conn>(fd);
+      watch(fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+    }
+  }
+
+  void respond(shared_ptr<Conn> c, u32 id, bool late, double queued, string& req) {
+    BufferedWriter w(-1);
+    if (! late)
+      handle_(req, w, c->cancel, queued);
+    string header;
+    put_u32(header, id);
+    put_u32(header, w.buf.size());
+    header += char(late ? FRAME_SHED : FRAME_SERVED);
+    pthread_mutex_lock(&mutex_);
+    c->out.push_back(move(header));
+    if (w.buf.size())
+      c->out.push_back(move(w.buf));
+    c->inflight--;
+    done_.push_back(c);
+    pthread_mutex_unlock(&mutex_);
+    u64 one = 1;
+    if (write(done_fd_, &one, sizeof one) < 0)
+      err_msg("write");
+  }
+
+  // dispatches complete frames, reads while there is room, writes pending responses
+  void pump(const shared_ptr<Conn>& c) {
+    if (c->closed) return;
+    for(;;) {
+      c->held = false;
+      while (! c->dead && c->in.size()-c->in_pos >= 8) {
+        const char *p = &c->in[c->in_pos];
+        u32 id = get_u32(p), len = get_u32(p+4);
+        if (len > size_limit_) {
+          c->dead = true;
+          break;
+        }
+        if (c->in.size()-c->in_pos < 8+len) break;
+        // only this thread increments `inflight`
+        pthread_mutex_lock(&mutex_);
+        bool room = c->inflight < inflight_limit_;
+        pthread_mutex_unlock(&mutex_);
+        auto req = make_shared<string>(p+8, len);
+        long lane = classify_ ? classify_(*req) : 0;
+        // other lanes shed instead of holding the connection
+        if (! room || (! lane && pool_->full())) {
+          c->held = true;
+          break;
+        }
+        pthread_mutex_lock(&mutex_);
+        c->inflight++;
+        pthread_mutex_unlock(&mutex_);
+        c->in_pos += 8+len;
+        pool_->push([this, c, id, req](bool late, double queued) { respond(c, id, late, queued, *req); }, lane);
+      }
+      if (c->in_pos) {
+        c->in.erase(0, c->in_pos);
+        c->in_pos = 0;
+      }
+      // `pump` runs again when a response completes or the pool drains, so reading can pause here
+      if (c->dead || c->eof || c->held || long(c->in.size()) >= 8+size_limit_) break;
+      char buf[1 << 14];
+      ssize_t n = read(c->fd, buf, sizeof buf);
+      if (n > 0)
+        c->in.append(buf, n);
+      else if (n == 0)
+        c->eof = true;
+      else if (errno != EINTR) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          c->dead = true;
+        break;
+      }
+    }
+
+    pthread_mutex_lock(&mutex_);
+    while (! c->dead && c->out.size()) {
+      iovec iov[64];
+      msghdr msg = {};
+      msg.msg_iov = iov;
+      for (auto it = c->out.begin(); it != c->out.end() && msg.msg_iovlen < LEN_OF(iov); ++it) {
+        size_t from = it == c->out.begin() ? c->out_pos : 0;
+        iov[msg.msg_iovlen].iov_base = &(*it)[from];
+        iov[msg.msg_iovlen++].iov_len = it->size()-from;
+      }
+      ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+          c->dead = true;
+        break;
+      }
+      for (size_t t; n > 0; n -= t)
+        if ((t = min(size_t(n), c->out.front().size()-c->out_pos)) == c->out.front().size()-c->out_pos) {
+          c->out.pop_front();
+          c->out_pos = 0;
+        } else
+          c->out_pos += t;
     }
-    void weave() {
-      for(;;) {
-        for (; x && l <= max; x = x->c[1]) {
-          st.emplace_back(x, l, h);
-          l = x->key;
+    bool finished = c->dead || (c->eof && ! c->inflight && ! c->held && c->out.empty());
+    if (finished)
+      c->closed = true;
+    if (c->dead)
+      c->cancel.cancelled = true;
+    pthread_mutex_unlock(&mutex_);
+    if (finished) {
+      close(c->fd);
+      conns_.erase(c->fd);
+    }
+  }
+
+public:
+  ~FrameServer() {
+    for (auto& x: conns_)
+      close(x.first);
+    if (sockfd_ >= 0) close(sockfd_);
+    if (epfd_ >= 0) close(epfd_);
+    if (done_fd_ >= 0) close(done_fd_);
+  }
+
+  void init(const char *path, WorkerPool& pool, long size_limit, long inflight_limit,
+            function<void(string&, BufferedWriter&, CancelToken&, double)> handle, function<long(const string&)> classify = nullptr) {
+    pool_ = &pool;
+    handle_ = handle;
+    classify_ = classify;
+    size_limit_ = size_limit;
+    inflight_limit_ = max(inflight_limit, 1L);
+    if ((sockfd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+      err_exit(EX_OSERR, "socket");
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+    unlink(path);
+    if (bind(sockfd_, (struct sockaddr *)&addr, sizeof addr) < 0)
+      err_exit(EX_OSERR, "bind");
+    if (listen(sockfd_, SOMAXCONN) < 0)
+      err_exit(EX_OSERR, "listen");
+    if ((epfd_ = epoll_create1(EPOLL_CLOEXEC)) < 0)
+      err_exit(EX_OSERR, "epoll_create1");
+    if ((done_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+      err_exit(EX_OSERR, "eventfd");
+    watch(sockfd_, EPOLLIN);
+    watch(done_fd_, EPOLLIN);
+  }
+
+  int fd() const { return epfd_; }
+
+  void process() {
+    epoll_event evs[64];
+    int n;
+    while ((n = epoll_wait(epfd_, evs, LEN_OF(evs), 0)) > 0)
+      REP(i, n) {
+        int fd = evs[i].data.fd;
+        if (fd == sockfd_)
+          accept_all();
+        else if (fd == done_fd_) {
+          u64 x;
+          while (read(done_fd_, &x, sizeof x) > 0);
+          vector<shared_ptr<Conn>> done;
+          pthread_mutex_lock(&mutex_);
+          done.swap(done_);
+          pthread_mutex_unlock(&mutex_);
+          for (auto& c: done)
+            pump(c);
+        } else {
+          auto it = conns_.find(fd);
+          if (it == conns_.end()) continue;
+          if (evs[i].events & (EPOLLHUP | EPOLLERR))
+            it->second->cancel.cancelled = true;
+          pump(shared_ptr<Conn>(it->second));
         }
-        if (st.empty()) {
-          x = nullptr;
-          return;
+      }
+  }
+
+  // the pool has room again: dispatch frames held back while it was full
+  void resume() {
+    vector<shared_ptr<Conn>> all;
+    for (auto& x: conns_)
+      if (x.second->held)
+        all.push_back(x.second);
+    for (auto& c: all)
+      pump(c);
+  }
+};
+
+// Epoch-based reclamation for structures that readers traverse without locks.
+// A reader stays within an EpochGuard while it holds pointers into the
+// structure. A writer publishes a new version, then calls `synchronize` before
+// freeing the old one: it returns once every reader that may still see the old
+// version has left its guard.
+namespace Epoch
+{
+  struct Slot {
+    atomic<u64> epoch{0}; // epoch the thread entered in, 0 outside of a guard
+    long depth = 0;
+    Slot* next = nullptr;
+  };
+  atomic<u64> global{1};
+  atomic<Slot*> slots{nullptr};
+
+  Slot* slot() {
+    static thread_local Slot* mine = nullptr;
+    if (! mine) {
+      mine = new Slot;
+      mine->next = slots.load();
+      while (! slots.compare_exchange_weak(mine->next, mine));
+    }
+    return mine;
+  }
+
+  void synchronize() {
+    u64 e = global.fetch_add(1);
+    for (Slot* s = slots.load(); s; s = s->next)
+      for (u64 x; (x = s->epoch.load()) && x <= e; )
+        sched_yield();
+  }
+}
+
+struct EpochGuard {
+  Epoch::Slot* s = Epoch::slot();
+  EpochGuard() { if (! s->depth++) s->epoch.store(Epoch::global.load()); }
+  ~EpochGuard() { if (! --s->depth) s->epoch.store(0); }
+};
+
+// Entries keyed by path, each covering the paths [low, key]. Writers, serialized
+// by the caller, edit `entries`; `publish` then turns them into an immutable
+// sorted Snapshot that readers use within an EpochGuard. Replaced snapshots
+// wait in `retired` until the caller frees them after Epoch::synchronize.
+template<class Val>
+class Catalog
+{
+public:
+  class Snapshot
+  {
+    string arena_;              // keys and low keys, each NUL-terminated
+    vector<u32> key_, low_;     // offsets into `arena_`, by increasing key
+    vector<u32> min_low_;       // segment tree over the items, leaves from `leaves_`: node -> item with the least low key below it
+    size_t leaves_ = 1;
+    vector<Val> vals_;
+
+    const char* key(size_t i) const { return &arena_[key_[i]]; }
+    const char* low(size_t i) const { return &arena_[low_[i]]; }
+    // a node whose items include one starting at most at `k`; padding leaves hold size()
+    bool reaches(size_t node, const char* k) const { return min_low_[node] < vals_.size() && strcmp(low(min_low_[node]), k) <= 0; }
+
+    // first item from `i` on starting at most at `k`, or size()
+    size_t next_low(size_t i, const char* k) const {
+      if (i >= vals_.size()) return vals_.size();
+      size_t node = leaves_+i;
+      // walk right along the canonical cover of [i, size()) until a subtree reaches `k`, then descend to its leftmost such item
+      while (! reaches(node, k)) {
+        while (node & 1)
+          node >>= 1;
+        if (! node) return vals_.size();
+        node++;
+      }
+      while (node < leaves_)
+        node = reaches(2*node, k) ? 2*node : 2*node+1;
+      return node-leaves_;
+    }
+  public:
+    explicit Snapshot(const map<string, pair<string, Val>>& entries) {
+      for (auto& x: entries) {
+        key_.push_back(arena_.size());
+        arena_ += x.first;
+        arena_ += '\0';
+        if (x.second.first == x.first)
+          low_.push_back(key_.back());
+        else {
+          low_.push_back(arena_.size());
+          arena_ += x.second.first;
+          arena_ += '\0';
         }
-        tie(x, l, h) = st.back();
-        st.pop_back();
-        if (min <= x->key && x->key <= max) return;
-        step();
+        vals_.push_back(x.second.second);
       }
+      while (leaves_ < vals_.size())
+        leaves_ *= 2;
+      min_low_.assign(2*leaves_, vals_.size());
+      REP(i, vals_.size())
+        min_low_[leaves_+i] = i;
+      ROF(i, 1, leaves_) {
+        u32 x = min_low_[2*i], y = min_low_[2*i+1];
+        min_low_[i] = y < vals_.size() && strcmp(low(y), low(x)) < 0 ? y : x;
+      }
+    }
+    size_t size() const { return vals_.size(); }
+
+    // first item with a key not less than `k`
+    size_t lower_bound(const char* k) const {
+      size_t l = 0, h = vals_.size();
+      while (l < h) {
+        size_t m = l+(h-l)/2;
+        if (strcmp(key(m), k) < 0) l = m+1;
+        else h = m;
+      }
+      return l;
+    }
+
+    const Val* find(const string& k) const {
+      size_t i = lower_bound(k.c_str());
+      return i < vals_.size() && k == key(i) ? &vals_[i] : nullptr;
+    }
+
+    // calls f(val) for the items intersecting [lo, hi] by increasing key: a contiguous
+    // scan of the keys in range, then a descent of the tree to each later item starting at most at `hi`
+    template<class F>
+    void overlapping(const string& lo, const string& hi, F f) const {
+      size_t i = lower_bound(lo.c_str());
+      for (; i < vals_.size() && strcmp(key(i), hi.c_str()) <= 0; i++)
+        f(vals_[i]);
+      for (i = next_low(i, hi.c_str()); i < vals_.size(); i = next_low(i+1, hi.c_str()))
+        f(vals_[i]);
+    }
+  };
+
+  vector<Snapshot*> retired;
+
+  ~Catalog() {
+    clear();
+    delete current_.load();
+  }
+
+  // once there are no readers
+  void clear() {
+    entries_.clear();
+    publish();
+    for (auto x: retired)
+      delete x;
+    retired.clear();
+  }
+
+  // the latest version, including unpublished edits
+  Val* find(const string& key) {
+    auto it = entries_.find(key);
+    return it == entries_.end() ? nullptr : &it->second.second;
+  }
+  void insert(const string& key, const Val& val) { insert(key, key, val); }
+  void insert(const string& low, const string& key, const Val& val) {
+    entries_[key] = make_pair(low, val);
+    dirty_ = true;
+  }
+  void erase(const string& key) {
+    dirty_ |= entries_.erase(key) > 0;
+  }
+
+  bool dirty() const { return dirty_; }
+  void publish() {
+    if (Snapshot* old = current_.exchange(new Snapshot(entries_)))
+      retired.push_back(old);
+    dirty_ = false;
+  }
+  // for readers within an EpochGuard
+  const Snapshot& snapshot() const { return *current_.load(); }
+
+private:
+  map<string, pair<string, Val>> entries_; // key -> low key, value
+  atomic<Snapshot*> current_{new Snapshot({})};
+  bool dirty_ = false;
+};
+
+///// .ap
+
+// appends printable bytes except HTML metacharacters and \ as is, others as \x??
+void escape_html(const u8 *a, off_t len, string &ret)
+{
+  const char ab[] = "0123456789abcdef";
+  REP(i, len)
+    if (isprint(a[i]) && ! strchr("\\<>&\"'", a[i]))
+      ret += a[i];
+    else {
+      ret += "\\x";
+      ret += ab[a[i]>>4&15];
+      ret += ab[a[i]&15];
     }
-    RangeBackward begin() { weave(); return *this; }
-    RangeBackward end() { return RangeBackward{nullptr, l, h, min, max}; }
-    bool operator!=(const RangeBackward& o) { return x != o.x; }
-    RangeBackward operator++() { step(); weave(); return *this; }
-    Node& operator*() { return *x; }
+}
+
+// a .ap file written by split-flow: ApHeader, then for each flow a FlowHeader followed by the payload of its packets
+
+#if __WORDSIZE == 32
+const char AP_MAGIC[] = {'A','P','A','P'};
+#elif __WORDSIZE == 64
+const char AP_MAGIC[] = {'A','A','P','P','A','A','P','P'};
+#else
+# error "not supported"
+#endif
+
+struct ApHeader {
+  char magic[sizeof(AP_MAGIC)];
+  int n_flows;
+  off_t pcap_size;
+  off_t flow_offsets[0];
+} __attribute__((packed));
+
+struct FlowKey {
+  u32 client_ip, server_ip;
+  u16 client_port, server_port;
+  bool operator<(const FlowKey& rhs) const {
+    if (client_ip != rhs.client_ip) return client_ip < rhs.client_ip;
+    if (server_ip != rhs.server_ip) return server_ip < rhs.server_ip;
+    if (client_port != rhs.client_port) return client_port < rhs.client_port;
+    return server_port < rhs.server_port;
+  }
+};
+
+struct FlowPacket {
+  off_t pcap_offset, pcap_payload_offset, ap_offset, len;
+  bool from_server;
+  bool operator<(const FlowPacket& o) const {
+    if (pcap_offset != o.pcap_offset) return pcap_offset < o.pcap_offset;
+    return from_server < o.from_server;
+  }
+} __attribute__((packed));
+
+struct FlowHeader {
+  FlowKey key;
+  u32 unix_time;
+  int n_packets;
+  FlowPacket packets[0];
+} __attribute__((packed));
+
+///// .apz: seekable block-compressed file
+
+// ApzHeader, the offsets of n_frames+1 frames, then frames of frame_size bytes of the original file (the last one shorter), each compressed with zlib
+const char APZ_MAGIC[] = {'A','P','Z','F','R','A','M','E'};
+const long APZ_CACHE_FRAMES = 8;
+
+struct ApzHeader {
+  char magic[sizeof(APZ_MAGIC)];
+  u64 size;
+  u32 frame_size, n_frames;
+  u64 frame_offsets[0];
+} __attribute__((packed));
+
+// writes `size` bytes of `data` as .apz to `fh` from its beginning
+bool apz_write(FILE *fh, const u8 *data, off_t size, u32 frame_size, int level)
+{
+  ApzHeader hdr;
+  memcpy(hdr.magic, APZ_MAGIC, sizeof APZ_MAGIC);
+  hdr.size = size;
+  hdr.frame_size = frame_size;
+  hdr.n_frames = (size+frame_size-1)/frame_size;
+  vector<u64> offsets{sizeof hdr+sizeof(u64)*(hdr.n_frames+1)};
+  vector<u8> buf(compressBound(frame_size));
+  if (fseeko(fh, offsets[0], SEEK_SET) < 0)
+    return false;
+  for (off_t i = 0; i < size; i += frame_size) {
+    uLongf n = buf.size();
+    if (compress2(buf.data(), &n, data+i, min(off_t(frame_size), size-i), level) != Z_OK ||
+        fwrite(buf.data(), 1, n, fh) != n)
+      return false;
+    offsets.push_back(offsets.back()+n);
+  }
+  return fseeko(fh, 0, SEEK_SET) == 0 &&
+    fwrite(&hdr, sizeof hdr, 1, fh) == 1 &&
+    fwrite(offsets.data(), sizeof(u64), offsets.size(), fh) == offsets.size() &&
+    fflush(fh) == 0 &&
+    ftruncate(fileno(fh), offsets.back()) == 0;
+}
+
+// read-only view of a mapped .apz; frames are decompressed on demand into a small per-thread cache
+class ApzFile
+{
+  const u8 *data_ = nullptr;
+  const ApzHeader *hdr_ = nullptr;
+  ulong id_ = 0; // cache key, unique among all views
+
+  struct Slot {
+    ulong id = 0, frame = 0, used = 0;
+    string buf;
   };
 
-  RangeBackward range_backward(Node* x, Key l, Key h, Key min, Key max) { return RangeBackward{x, l, h, min, max}; }
+  // decompressed frame `k`, nullptr if corrupt
+  const string *frame(ulong k) const {
+    static thread_local Slot slots[APZ_CACHE_FRAMES];
+    static thread_local ulong clock = 0;
+    Slot *victim = slots;
+    for (auto &slot: slots) {
+      if (slot.id == id_ && slot.frame == k) {
+        slot.used = ++clock;
+        return &slot.buf;
+      }
+      if (slot.used < victim->used)
+        victim = &slot;
+    }
+    uLongf n = min(u64(hdr_->frame_size), hdr_->size-k*hdr_->frame_size);
+    victim->buf.resize(n);
+    victim->id = 0;
+    if (uncompress((Bytef *)&victim->buf[0], &n, data_+hdr_->frame_offsets[k], hdr_->frame_offsets[k+1]-hdr_->frame_offsets[k]) != Z_OK ||
+        n != victim->buf.size())
+      return nullptr;
+    victim->id = id_;
+    victim->frame = k;
+    victim->used = ++clock;
+    return &victim->buf;
+  }
+public:
+  // false if `data` is not a well-formed .apz
+  bool init(const void *data, off_t size) {
+    static atomic<ulong> ids{0};
+    auto hdr = (const ApzHeader *)data;
+    data_ = nullptr;
+    if (size < off_t(sizeof(ApzHeader)) || memcmp(hdr->magic, APZ_MAGIC, sizeof APZ_MAGIC) || ! hdr->frame_size ||
+        hdr->n_frames != (hdr->size+hdr->frame_size-1)/hdr->frame_size ||
+        off_t(sizeof(ApzHeader)+sizeof(u64)*(hdr->n_frames+1)) > size)
+      return false;
+    REP(i, hdr->n_frames+1)
+      if (hdr->frame_offsets[i] > size || i && hdr->frame_offsets[i] < hdr->frame_offsets[i-1])
+        return false;
+    data_ = (const u8 *)data;
+    hdr_ = hdr;
+    id_ = ++ids;
+    return true;
+  }
+  bool valid() const { return data_; }
+  off_t size() const { return hdr_->size; }
+
+  // appends [off, off+len) clipped to the original file; bytes of corrupt frames are zeros
+  void read(off_t off, off_t len, string &ret) const {
+    for (off_t end = min(off+len, size()); off < end; ) {
+      ulong k = off/hdr_->frame_size, from = off%hdr_->frame_size, n = min(off_t(hdr_->frame_size-from), end-off);
+      auto f = frame(k);
+      if (f)
+        ret.append(*f, from, n);
+      else
+        ret.append(n, '\0');
+      off += n;
+    }
+  }
+};
+
+// read-only view of a mapped .ap file, or of a .apz of one
+// a .apz keeps the ApHeader and the flow and packet headers decompressed in memory, payloads are decompressed on demand
+class ApFile
+{
+  const u8 *data_ = nullptr; // null if compressed
+  off_t size_ = 0;
+  bool valid_ = false;
+  ApzFile apz_;
+  string headers_; // if compressed: ApHeader, then the FlowHeader (with packets) of each flow
+  vector<off_t> flow_pos_; // if compressed: position of the FlowHeader of each flow in headers_
+public:
+  // false if `data` does not begin with a well-formed ApHeader
+  bool init(const void *data, off_t size) {
+    data_ = nullptr;
+    size_ = 0;
+    valid_ = false;
+    headers_.clear();
+    flow_pos_.clear();
+    if (apz_.init(data, size)) {
+      size = apz_.size();
+      apz_.read(0, sizeof(ApHeader), headers_);
+      data = headers_.data();
+    }
+    auto hdr = (const ApHeader *)data;
+    if (size < off_t(sizeof(ApHeader)) || memcmp(hdr->magic, AP_MAGIC, sizeof AP_MAGIC) ||
+        hdr->n_flows < 0 || off_t(sizeof(ApHeader)+sizeof(off_t)*hdr->n_flows) > size)
+      return false;
+    size_ = size;
+    if (apz_.valid()) {
+      long n = hdr->n_flows;
+      apz_.read(sizeof(ApHeader), sizeof(off_t)*n, headers_);
+      REP(i, n) {
+        off_t o = header()->flow_offsets[i], m = headers_.size();
+        if (o < 0 || o+off_t(sizeof(FlowHeader)) > size) return false;
+        flow_pos_.push_back(m);
+        apz_.read(o, sizeof(FlowHeader), headers_);
+        auto packets = ((const FlowHeader *)&headers_[m])->n_packets;
+        if (packets < 0) return false;
+        apz_.read(o+sizeof(FlowHeader), sizeof(FlowPacket)*packets, headers_);
+      }
+      headers_.shrink_to_fit();
+    } else
+      data_ = (const u8 *)data;
+    valid_ = true;
+    return true;
+  }
+  bool valid() const { return valid_; }
+  bool compressed() const { return valid_ && ! data_; }
+  off_t size() const { return size_; }
+  const u8 *data() const { return data_; }
+  const ApHeader *header() const { return (const ApHeader *)(data_ ? data_ : (const u8 *)headers_.data()); }
+  long n_flows() const { return valid_ ? header()->n_flows : 0; }
+  const FlowHeader *flow(long i) const {
+    return (const FlowHeader *)(data_ ? data_+header()->flow_offsets[i] : (const u8 *)headers_.data()+flow_pos_[i]);
+  }
+
+  // bytes [off, off+len) of the file: in place, or decompressed into `buf`
+  const u8 *bytes(off_t off, off_t len, string &buf) const {
+    if (data_) return data_+off;
+    buf.clear();
+    apz_.read(off, len, buf);
+    return (const u8 *)buf.data();
+  }
+
+  // payload of flow `i`: [payload_begin(i), flow_end(i))
+  off_t payload_begin(long i) const { return header()->flow_offsets[i]+sizeof(FlowHeader)+sizeof(FlowPacket)*flow(i)->n_packets; }
+  off_t flow_end(long i) const { return i+1 < n_flows() ? header()->flow_offsets[i+1] : size_; }
+
+  // the flow whose payload contains [offset, offset+len), or -1
+  long flow_of(off_t offset, off_t len = 1) const {
+    if (! valid_) return -1;
+    // flow_offsets may be unaligned: compare element by element rather than through a pointer
+    long lo = 0, hi = n_flows();
+    while (lo < hi) {
+      long mid = lo+(hi-lo)/2;
+      if (header()->flow_offsets[mid] <= offset) lo = mid+1;
+      else hi = mid;
+    }
+    long i = lo-1;
+    if (i < 0 || offset < payload_begin(i) || flow_end(i) < offset+len) return -1;
+    return i;
+  }
+
+  // index of the packet of flow `i` whose payload contains `offset`
+  long packet_of(long i, off_t offset) const {
+    auto f = flow(i);
+    long j = upper_bound(f->packets, f->packets+f->n_packets, offset, [](off_t x, const FlowPacket &p) { return x < p.ap_offset; })-f->packets;
+    return max(j-1, 0L);
+  }
+
+  // appends the HTML of [offset-left, offset+len+right) clipped to flow `i`, colored by direction, [offset, offset+len) highlighted
+  // payload bytes are read from `bytes` (holding the file from offset `bytes_offset` on) if given
+  void context(long i, off_t offset, off_t len, off_t left, off_t right, string &ret, const u8 *bytes = nullptr, off_t bytes_offset = 0) const {
+    auto f = flow(i);
+    string window;
+    if (! bytes) {
+      bytes_offset = max(offset-left, payload_begin(i));
+      bytes = this->bytes(bytes_offset, min(offset+len+right, flow_end(i))-bytes_offset, window);
+    }
+    auto span = [&](string &ret, long j, off_t from, off_t n, bool highlight) {
+      ret += f->packets[j].from_server ? "<span class=\"red" : "<span class=\"green";
+      ret += highlight ? " highlight\">" : "\">";
+      escape_html(bytes+f->packets[j].ap_offset+from-bytes_offset, n, ret);
+      ret += "</span>";
+    };
+    long pi = packet_of(i, offset), j = pi;
+    off_t po = offset-f->packets[pi].ap_offset;
+    vector<string> lefts;
+    for (off_t t; left > 0; po = f->packets[--j].len) {
+      if ((t = min(po, left)) > 0) {
+        lefts.emplace_back();
+        span(lefts.back(), j, po-t, t, false);
+        left -= t;
+      }
+      if (! j) break;
+    }
+    for (auto it = lefts.rbegin(); it != lefts.rend(); ++it)
+      ret += *it;
+    j = pi;
+    po = offset-f->packets[pi].ap_offset;
+    for (auto part: {make_pair(len, true), make_pair(right, false)})
+      for (off_t n = part.first, t; j < f->n_packets && n > 0; ) {
+        if ((t = min(f->packets[j].len-po, n)) > 0) {
+          span(ret, j, po, t, part.second);
+          n -= t;
+          po += t;
+        }
+        if (po >= f->packets[j].len) {
+          j++;
+          po = 0;
+        }
+      }
+  }
 };
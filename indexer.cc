@@ -4,6 +4,8 @@ using namespace std;
 const char MAGIC_BAD[] = "BAD MEOW"; // first sizeof(off_t) bytes
 const char MAGIC_GOOD[] = "GOODMEOW"; // first sizeof(off_t) bytes
 const long LOGAB = CHAR_BIT, AB = 1L << LOGAB;
+const long INDEX_VERSION = 3; // bump when the layout of index files changes
+enum { INDEX_REVERSE = 1, INDEX_PAYLOAD = 2, INDEX_PACK = 4, INDEX_ISA = 8 };
 
 const char *listen_path = "/tmp/search.sock";
 const pthread_t main_thread = pthread_self();
@@ -12,15 +14,49 @@ string data_suffix = ".ap";
 string index_suffix = ".fm";
 long autocomplete_limit = 20;
 long autocomplete_length = 20;
+long autocomplete_budget = 4096;
 long search_limit = 20;
 long fmindex_sample_rate = 32;
 long indexer_limit = 0;
 long rrr_sample_rate = 8;
+long search_budget = 1L << 20;
+long approx_max_distance = 4;
+double approx_cpu_limit = 1;
 double request_timeout = 1;
 long request_count = -1;
+long request_size_limit = 1L << 20;
+long batch_threads = 0;
+long left_context = 50;
+long right_context = 30;
+long aggregate_sample = 1L << 16;
+long pack_file_limit = 1L << 20;
+long pack_min_files = 16;
+long pack_size_limit = 1L << 28;
+long request_threads = 0;
+long request_queue = 64;
+double queue_timeout = 1;
+string frame_path;
+string tcp_listen;
+long tcp_acceptors = 0;
+vector<string> backends; // with backends, this instance coordinates them instead of indexing
+double backend_timeout = 5;
+long frame_inflight = 16;
+// request classes, each served in its own lane of the worker pool; a free thread prefers earlier classes
+enum { LANE_AUTOCOMPLETE, LANE_SEARCH, LANE_COUNT, LANE_EXPORT, LANE_BATCH, N_LANES };
+const char *lane_names[N_LANES] = {"autocomplete", "search", "count", "export", "batch"};
+long lane_quota[N_LANES] = {}; // 0: derived from request_threads
+long lane_queue[N_LANES] = {}; // 0: request_queue
+double lane_deadline[N_LANES] = {0.05}; // seconds, 0: none
+vector<int> build_cpus, request_cpus; // empty: the CPUs the process may run on
+long build_nice = 10;
+long build_ioprio = 7; // best-effort level of index builds, -1: idle class
+double throttle_p99 = 0; // seconds, 0: builds are not throttled
 bool opt_force_rebuild = false;
 bool opt_inotify = true;
 bool opt_recursive = false;
+bool opt_reverse_index = true;
+bool opt_payload_index = true;
+bool opt_context_from_index = false;
 
 ///// common
 
@@ -79,6 +115,14 @@ string escape(const string &str)
   return ret;
 }
 
+// LEB128
+void put_varint(string &s, ulong x)
+{
+  for (; x >= 0x80; x >>= 7)
+    s += char(x & 0x7f | 0x80);
+  s += char(x);
+}
+
 string unescape(size_t n, const char *str)
 {
   auto from_hex = [&](int c) {
@@ -120,6 +164,25 @@ string unescape(size_t n, const char *str)
   return ret;
 }
 
+// the other ASCII case of `c`, or `c` itself
+u8 swap_case(u8 c)
+{
+  if ('a' <= c && c <= 'z') return c-'a'+'A';
+  if ('A' <= c && c <= 'Z') return c-'A'+'a';
+  return c;
+}
+
+// UTF-16LE encoding of ASCII text
+string widen(const string &str)
+{
+  string ret;
+  for (char c: str) {
+    ret += c;
+    ret += '\0';
+  }
+  return ret;
+}
+
 ///// vector
 
 template<class T>
@@ -211,6 +274,7 @@ public:
   }
 
   ulong get_bits(ulong x, ulong k) const {
+    if (! k) return 0;
     if (x % BITS + k <= BITS)
       return (a[x/BITS] >> x%BITS) & (1ul<<k)-1;
     return (a[x/BITS] >> x%BITS | a[x/BITS+1] << BITS-x%BITS) & (1ul<<k)-1;
@@ -489,8 +553,9 @@ public:
     }
     nsamples = (nblocks-1+sample_len)/sample_len;
     klass_bits = clog2(block_len+1);
-    rsample_bits = clog2(rank_sum);
-    osample_bits = clog2(offset_sum);
+    // samples range over [0, rank_sum] and [0, offset_sum]
+    rsample_bits = clog2(rank_sum+1);
+    osample_bits = clog2(offset_sum+1);
     klasses.init(klass_bits*nblocks);
     offsets.init(offset_sum);
     rank_samples.init(rsample_bits*nsamples);
@@ -615,8 +680,8 @@ public:
     nblocks = (n-1+block_len)/block_len;
     nsamples = (nblocks-1+sample_len)/sample_len;
     klass_bits = clog2(block_len+1);
-    rsample_bits = clog2(rank_sum);
-    osample_bits = clog2(offsets.size());
+    rsample_bits = clog2(rank_sum+1);
+    osample_bits = clog2(offsets.size()+1);
     RRRTable::raise(block_len+1);
   }
 };
@@ -627,7 +692,7 @@ public:
   ulong n, bound, l, num = 0, pos = 0;
   BitSet lows, highs;
 
-  EliasFanoBuilder(ulong n, ulong bound) : EliasFanoBuilder(n, bound, n && clog2(bound/n)) {}
+  EliasFanoBuilder(ulong n, ulong bound) : EliasFanoBuilder(n, bound, n ? clog2(bound/n) : 0) {}
 
   EliasFanoBuilder(ulong n, ulong bound, ulong l) : n(n), bound(bound), l(l), lows(l*n), highs((bound>>l)+n+1) {}
 
@@ -663,7 +728,7 @@ public:
   }
 
   ulong rank(ulong x) const {
-    if (x > bound) return n;
+    if (! n || x > bound) return n;
     ulong hi = x >> l, lo = x & (1ul<<l)-1;
     ulong i = highs.select0(hi),
           r = i - hi; // number of elements in highs <= hi
@@ -737,6 +802,22 @@ public:
       ? rank(d+1, l, m, x, rrr[d].rank0(i), rrr[d].rank0(p))
       : rank(d+1, m, h, x, z+rrr[d].rank1(i), z+rrr[d].rank1(p));
   }
+  // for each distinct symbol `x` in [l,h) and `mask`, call f(x, rank(x, l), rank(x, h)) in increasing order of `x`
+  template<class F>
+  void range_symbols(ulong l, ulong h, const bitset<AB> &mask, F f) const {
+    range_symbols(0, 0, AB, l, h, 0, mask, f);
+  }
+  template<class F>
+  void range_symbols(ulong d, ulong lo, ulong hi, ulong l, ulong h, ulong p, const bitset<AB> &mask, F& f) const {
+    if (l >= h || ! (mask >> lo << AB-(hi-lo)).any()) return;
+    if (hi-lo == 1) {
+      f(lo, l-p, h-p);
+      return;
+    }
+    ulong m = lo+hi >> 1, z = rrr[d].zero_bits();
+    range_symbols(d+1, lo, m, rrr[d].rank0(l), rrr[d].rank0(h), rrr[d].rank0(p), mask, f);
+    range_symbols(d+1, m, hi, z+rrr[d].rank1(l), z+rrr[d].rank1(h), z+rrr[d].rank1(p), mask, f);
+  }
   // position of `k`-th occurrence of symbol `x`
   ulong select(ulong x, ulong k) const {
     return select(0, 0, AB, x, k, 0);
@@ -757,17 +838,188 @@ public:
   }
 };
 
+///// data files
+
+// a data file, indexed alone or as a member of a pack
+struct Doc
+{
+  string path;
+  int fd = -1;
+  off_t size = 0;
+  void *mmap = MAP_FAILED;
+  ulong begin = 0, length = 0; // [begin, begin+length): its (decompressed) contents in the concatenation of the data files of an index
+  ApFile ap; // invalid if not a .ap file
+
+  ~Doc() {
+    if (mmap != MAP_FAILED)
+      munmap(mmap, size);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool open(const string &path) {
+    this->path = path;
+    if ((fd = ::open(path.c_str(), O_RDONLY)) < 0)
+      return false;
+    if ((size = lseek(fd, 0, SEEK_END)) < 0)
+      return false;
+    if (size > 0 && (mmap = ::mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+      return false;
+    length = ap.init(mmap, size) ? ap.size() : size;
+    return true;
+  }
+
+  // bytes [off, off+len) of the contents: in place, or decompressed into `buf`
+  const u8 *bytes(off_t off, off_t len, string &buf) const {
+    return ap.compressed() ? ap.bytes(off, len, buf) : (const u8 *)mmap+off;
+  }
+};
+
+///// payload map
+
+// positions in the indexed text (payloads of the flows of .ap files, or whole data files of a pack, concatenated) -> data offsets in the
+// concatenation of the data files
+class PayloadMap
+{
+  ulong n_; // length of the text
+  EliasFano text_begin_, data_begin_; // of each non-empty payload
+  vector<pair<ulong, ulong>> regions_; // while building: [begin, end) of each non-empty payload
+public:
+  // appends the payloads of `doc` to `text`, or its whole contents if `payloads` is false or it is not a .ap file
+  void add(const Doc &doc, bool payloads, vector<u8> &text) {
+    auto &ap = doc.ap;
+    string buf;
+    auto append = [&](off_t b, off_t e) {
+      if (b >= e) return;
+      auto x = doc.bytes(b, e-b, buf);
+      regions_.emplace_back(doc.begin+b, doc.begin+e);
+      text.insert(text.end(), x, x+e-b);
+    };
+    if (! payloads || ! ap.valid())
+      append(0, doc.length);
+    else
+      REP(i, ap.n_flows())
+        append(ap.payload_begin(i), ap.flow_end(i));
+  }
+
+  // builds the map once every data file is added; `size` is the length of the concatenation
+  void finish(ulong size) {
+    n_ = 0;
+    EliasFanoBuilder tb(regions_.size(), size), db(regions_.size(), size);
+    for (auto &x: regions_) {
+      tb.push(n_);
+      db.push(x.first);
+      n_ += x.second-x.first;
+    }
+    text_begin_.init(tb);
+    data_begin_.init(db);
+    regions_.clear();
+    regions_.shrink_to_fit();
+  }
+
+  // index of the payload containing text position `pos`, and its end
+  ulong payload_of(ulong pos, ulong &end) const {
+    ulong r = text_begin_.rank(pos+1)-1;
+    end = r+1 < text_begin_.n ? text_begin_[r+1] : n_;
+    return r;
+  }
+
+  // length of the part of [pos, pos+len) of the text within the payload of `pos`
+  ulong clip(ulong pos, ulong len) const {
+    ulong end;
+    payload_of(pos, end);
+    return min(len, end-pos);
+  }
+
+  // text position of the data offset `off`, which lies in a payload
+  ulong to_text(ulong off) const {
+    ulong r = data_begin_.rank(off+1)-1;
+    return text_begin_[r]+off-data_begin_[r];
+  }
+
+  // data offset of the occurrence [pos, pos+len) of the text, -1 if it spans two payloads
+  long to_data(ulong pos, ulong len) const {
+    ulong end, r = payload_of(pos, end);
+    if (pos+len > end) return -1;
+    return data_begin_[r]+pos-text_begin_[r];
+  }
+
+  template<typename Archive>
+  void serialize(Archive &ar) {
+    ar & n_ & text_begin_ & data_begin_;
+  }
+};
+
 ///// FM-index
 
+// rows [l,h) of the suffix array whose suffixes begin with a matching string of length `len` at distance `dist`
+struct Match
+{
+  ulong l, h, len, dist;
+};
+
+// sort by l and merge adjacent intervals
+void coalesce(vector<Match> &ms)
+{
+  sort(ms.begin(), ms.end(), [](const Match &x, const Match &y) { return x.l < y.l; });
+  ulong j = 0;
+  for (auto &x: ms)
+    if (j && ms[j-1].h == x.l)
+      ms[j-1].h = x.h;
+    else
+      ms[j++] = x;
+  ms.resize(j);
+}
+
+// an occurrence
+struct Hit
+{
+  static const ulong SPANNING = ~0ul; // `pos` of an occurrence spanning two payloads, which is counted but not reported
+  ulong pos, len, dist;
+};
+
+// limits the work (and optionally the thread CPU time and a wall-clock deadline) of searches, which also stop once `cancel` is set
+struct Budget
+{
+  long work, ticks = 0;
+  double cpu_deadline = 0, deadline;
+  CancelToken *cancel;
+  bool expired = false;
+  Budget(long work, double cpu_limit = 0, double deadline = 0, CancelToken *cancel = nullptr) : work(work), deadline(deadline), cancel(cancel) {
+    if (cpu_limit > 0)
+      cpu_deadline = thread_cpu_time()+cpu_limit;
+  }
+  bool exhausted() const { return work <= 0; }
+  bool step() {
+    if (work % 1024 == 0 && interrupted())
+      work = 0;
+    return --work >= 0;
+  }
+  // checks the deadlines and `cancel` every `every` calls without consuming work; false once interrupted
+  bool alive(long every = 64) {
+    if (! expired && ++ticks % every == 0 && interrupted())
+      work = 0;
+    return ! expired;
+  }
+  bool interrupted() {
+    if (cpu_deadline > 0 && thread_cpu_time() > cpu_deadline ||
+        deadline > 0 && monotonic_time() > deadline ||
+        cancel && cancel->check())
+      expired = true;
+    return expired;
+  }
+};
+
 class FMIndex
 {
   ulong n_, samplerate_, initial_;
   ulong cnt_lt_[AB+1];
   EliasFano sampled_ef_;
   SArray<u32> ssa_;
+  SArray<u32> isa_; // rank of the suffix at each multiple of samplerate_, empty unless built with `isa`
   WaveletMatrix bwt_wm_;
 public:
-  void init(ulong n, const u8 *text, ulong samplerate) {
+  void init(ulong n, const u8 *text, ulong samplerate, bool isa) {
     samplerate_ = samplerate;
     n_ = n;
 
@@ -787,11 +1039,14 @@ public:
     ulong sampled_n = (n-1+samplerate)/samplerate;
     EliasFanoBuilder efb(sampled_n, n ? n-1 : 0);
     ssa_.init(sampled_n);
+    isa_.init(isa ? sampled_n : 0);
 
     ulong nn = 0;
     KoAluru::main(text, sa, tmp, n, AB);
     REP(i, n)
       if (sa[i] % samplerate == 0) {
+        if (isa)
+          isa_[sa[i]/samplerate] = i;
         ssa_[nn++] = sa[i];
         efb.push(i);
       }
@@ -829,6 +1084,28 @@ public:
     }
     return {l, h};
   }
+  ulong size() const { return n_; }
+
+  // case-insensitive backward search: rows of the strings equal to `pattern` up to ASCII case
+  // intervals are kept disjoint and sorted, adjacent ones merged, and empty ones dropped, instead of enumerating all case variants
+  vector<Match> get_ranges_icase(ulong m, const u8 *pattern) const {
+    vector<Match> cur{Match{0, n_, 0, 0}}, next;
+    REP(i, m) {
+      bitset<AB> mask;
+      mask.set(pattern[m-1-i]);
+      mask.set(swap_case(pattern[m-1-i]));
+      next.clear();
+      for (auto &x: cur)
+        backward_step(i, x.l, x.h, mask, [&](ulong, ulong l, ulong h) {
+          next.push_back(Match{l, h, m, 0});
+        });
+      coalesce(next);
+      swap(cur, next);
+      if (cur.empty()) break;
+    }
+    return cur;
+  }
+
   // m > 0
   ulong count(ulong m, const u8 *pattern) const {
     if (! m) return n_;
@@ -836,6 +1113,47 @@ public:
     return x.second-x.first;
   }
 
+  // for each symbol c in `mask` preceding some of the rows [l,h) of a pattern of length m, call f(c, l', h') where [l',h') are the rows of c+pattern
+  template<class F>
+  void backward_step(ulong m, ulong l, ulong h, const bitset<AB> &mask, F f) const {
+    if (! m) {
+      REP(c, AB)
+        if (mask[c] && cnt_lt_[c] < cnt_lt_[c+1])
+          f(c, cnt_lt_[c], cnt_lt_[c+1]);
+      return;
+    }
+    bwt_wm_.range_symbols(l + (l < initial_), h + (h < initial_), mask, [&](ulong c, ulong rl, ulong rh) {
+      f(c, cnt_lt_[c] + rl, cnt_lt_[c] + rh);
+    });
+  }
+
+  // called on the index of the reversed text: most frequent right continuations of `pattern` (reversed: `rpattern`)
+  // best-first by number of occurrences; at most `budget` nodes are expanded
+  void continuations(ulong m, const u8 *rpattern, ulong limit, ulong length, ulong &budget, vector<pair<ulong, string>> &res) const {
+    static const bitset<AB> all = bitset<AB>().set();
+    typedef tuple<ulong, string, ulong, ulong> node_type; // count, continuation, rows
+    priority_queue<node_type> q;
+    ulong l, h;
+    tie(l, h) = get_range(m, rpattern);
+    if (l < h)
+      q.emplace(h-l, string(), l, h);
+    while (q.size() && res.size() < limit) {
+      node_type x = q.top();
+      q.pop();
+      const string &cont = get<1>(x);
+      bool leaf = true;
+      if (cont.size() < length && budget) {
+        budget--;
+        backward_step(m+cont.size(), get<2>(x), get<3>(x), all, [&](ulong c, ulong l, ulong h) {
+          leaf = false;
+          q.emplace(h-l, cont+char(c), l, h);
+        });
+      }
+      if (leaf)
+        res.emplace_back(get<0>(x), cont);
+    }
+  }
+
   ulong calc_sa(ulong rank) const {
     ulong d = 0, i = rank;
     while (! sampled_ef_.exist(i)) {
@@ -846,6 +1164,26 @@ public:
     return ssa_[sampled_ef_.rank(i)] + d;
   }
 
+  // text [pos, pos+len) clipped to the text, walking backwards from the next sample of the inverse suffix array
+  string extract(ulong pos, ulong len) const {
+    ulong end = min(n_, pos+len), p = min(n_, (end+samplerate_-1)/samplerate_*samplerate_), i;
+    if (pos >= end) return string();
+    string ret(end-pos, '\0');
+    if (p == n_) {
+      // the last byte precedes the implicit sentinel, in the first row of the BWT
+      u8 c = bwt_wm_[0];
+      i = cnt_lt_[c];
+      if (--p < end) ret[p-pos] = c;
+    } else
+      i = isa_[p/samplerate_];
+    while (p > pos) {
+      u8 c = bwt_wm_[i + (i < initial_)];
+      i = cnt_lt_[c] + bwt_wm_.rank(c, i + (i < initial_));
+      if (--p < end) ret[p-pos] = c;
+    }
+    return ret;
+  }
+
   ulong locate(ulong m, const u8 *pattern, bool autocomplete, ulong limit, ulong &skip, vector<ulong> &res) const {
     ulong l, h, total;
     tie(l, h) = get_range(m, pattern);
@@ -859,6 +1197,27 @@ public:
     return total;
   }
 
+  // locate rows of `matches` in order, returning the total number of rows
+  // with `pmap`, positions are mapped to data offsets. An occurrence spanning two payloads is returned at Hit::SPANNING: like any
+  // other row it counts in the total, `skip` and `limit`, so the total and the pages do not depend on which rows were located
+  // with `budget`, stops early once its deadline passes or it is cancelled
+  ulong locate(const vector<Match> &matches, ulong limit, ulong &skip, vector<Hit> &res, const PayloadMap *pmap = nullptr, Budget *budget = nullptr) const {
+    ulong total = 0;
+    for (auto &x: matches) {
+      ulong l = x.l, delta = min(x.h-l, skip);
+      total += x.h-l;
+      l += delta;
+      skip -= delta;
+      for (; l < x.h && res.size() < limit && (! budget || budget->alive()); l++) {
+        long pos = calc_sa(l);
+        if (pmap)
+          pos = pmap->to_data(pos, x.len);
+        res.push_back(Hit{pos < 0 ? Hit::SPANNING : ulong(pos), x.len, x.dist});
+      }
+    }
+    return total;
+  }
+
   template<typename Archive>
   void serialize(Archive &ar) {
     ar & n_ & samplerate_ & initial_;
@@ -866,10 +1225,500 @@ public:
       ar & cnt_lt_[i];
     ar & sampled_ef_;
     ar & ssa_;
+    ar & isa_;
     ar & bwt_wm_;
   }
 };
 
+///// pattern
+
+// byte-class patterns evaluated by backtracking over backward search intervals
+//
+// literal bytes with \-escapes as in `unescape`, \x?? and \x?H with wildcard nibbles, `.`, `[a-f0-9]`, `[^\n]`,
+// grouping `(...)`, alternation `|`, bounded repeats `?`, `{m}`, `{m,n}`
+class Regex
+{
+  struct Ast {
+    enum { CLASS, CAT, ALT, REPEAT } type;
+    bitset<AB> cls;
+    vector<Ast> kids;
+    long lo, hi;
+  };
+  // a state either consumes a byte of `cls` and moves to `next`, or moves to `eps` without consuming
+  struct State {
+    bitset<AB> cls;
+    long next = -1;
+    vector<long> eps;
+  };
+  static const long MAX_REPEAT = 255, MAX_STATES = 1L << 14;
+  const char *p, *end;
+  bool icase, wide;
+  vector<State> states;
+  long start, accept;
+
+  static int from_hex(int c) {
+    if ('0' <= c && c <= '9') return c-'0';
+    if ('a' <= c && c <= 'f') return c-'a'+10;
+    if ('A' <= c && c <= 'F') return c-'A'+10;
+    return -1;
+  }
+
+  // a \-escape, p points past the backslash
+  bool parse_escape(bitset<AB> &cls) {
+    if (p == end) return false;
+    if (*p == 'x' && end-p >= 3) {
+      int hi = p[1] == '?' ? -1 : from_hex(p[1]), lo = p[2] == '?' ? -1 : from_hex(p[2]);
+      if ((hi < 0 && p[1] != '?') || (lo < 0 && p[2] != '?')) return false;
+      REP(c, AB)
+        if ((hi < 0 || c>>4 == hi) && (lo < 0 || (c&15) == lo))
+          cls.set(c);
+      p += 3;
+      return true;
+    }
+    switch (*p) {
+    case 'a': cls.set('\a'); p++; return true;
+    case 'b': cls.set('\b'); p++; return true;
+    case 't': cls.set('\t'); p++; return true;
+    case 'n': cls.set('\n'); p++; return true;
+    case 'v': cls.set('\v'); p++; return true;
+    case 'f': cls.set('\f'); p++; return true;
+    case 'r': cls.set('\r'); p++; return true;
+    }
+    if (unsigned(*p-'0') < 8) {
+      ulong v = 0;
+      for (long i = 0; i < 3 && p < end && unsigned(*p-'0') < 8; i++)
+        v = v*8+*p++-'0';
+      cls.set(v & AB-1);
+      return true;
+    }
+    cls.set(u8(*p++));
+    return true;
+  }
+
+  // a single byte in a bracket expression
+  bool parse_class_byte(bitset<AB> &cls) {
+    if (p == end) return false;
+    if (*p == '\\') {
+      p++;
+      return parse_escape(cls);
+    }
+    cls.set(u8(*p++));
+    return true;
+  }
+
+  bool parse_class(bitset<AB> &cls) {
+    bool negate = p < end && *p == '^';
+    if (negate) p++;
+    for (bool first = true; p < end && (first || *p != ']'); first = false) {
+      bitset<AB> lo;
+      if (! parse_class_byte(lo)) return false;
+      if (p+1 < end && *p == '-' && p[1] != ']') {
+        p++;
+        bitset<AB> hi;
+        if (! parse_class_byte(hi) || lo.count() != 1 || hi.count() != 1) return false;
+        ulong a = 0, b = 0;
+        while (! lo[a]) a++;
+        while (! hi[b]) b++;
+        for (; a <= b; a++)
+          cls.set(a);
+      } else
+        cls |= lo;
+    }
+    if (p == end) return false;
+    p++;
+    if (negate)
+      cls.flip();
+    return true;
+  }
+
+  bool parse_number(long &x) {
+    if (p == end || ! isdigit(*p)) return false;
+    for (x = 0; p < end && isdigit(*p) && x <= MAX_REPEAT; )
+      x = x*10+*p++-'0';
+    return x <= MAX_REPEAT;
+  }
+
+  bool parse_atom(Ast &x) {
+    x.type = Ast::CLASS;
+    switch (*p++) {
+    case '.':
+      x.cls.set();
+      return true;
+    case '[':
+      return parse_class(x.cls);
+    case '(':
+      if (! parse_alt(x) || p == end || *p != ')') return false;
+      p++;
+      return true;
+    case '\\':
+      return parse_escape(x.cls);
+    case ')': case '|': case '?': case '*': case '+': case '{':
+      return false;
+    default:
+      x.cls.set(u8(p[-1]));
+      return true;
+    }
+  }
+
+  bool parse_repeat(Ast &x) {
+    if (! parse_atom(x)) return false;
+    while (p < end && (*p == '?' || *p == '{')) {
+      Ast y;
+      y.type = Ast::REPEAT;
+      if (*p++ == '?')
+        y.lo = 0, y.hi = 1;
+      else {
+        if (! parse_number(y.lo)) return false;
+        y.hi = y.lo;
+        if (p < end && *p == ',') {
+          p++;
+          if (! parse_number(y.hi) || y.hi < y.lo) return false;
+        }
+        if (p == end || *p++ != '}') return false;
+      }
+      y.kids.push_back(move(x));
+      x = move(y);
+    }
+    return p == end || (*p != '*' && *p != '+');
+  }
+
+  bool parse_cat(Ast &x) {
+    x.type = Ast::CAT;
+    while (p < end && *p != '|' && *p != ')') {
+      x.kids.emplace_back();
+      if (! parse_repeat(x.kids.back())) return false;
+    }
+    return true;
+  }
+
+  bool parse_alt(Ast &x) {
+    x.type = Ast::ALT;
+    do {
+      x.kids.emplace_back();
+      if (! parse_cat(x.kids.back())) return false;
+    } while (p < end && *p == '|' && ++p);
+    return true;
+  }
+
+  long new_state() {
+    states.emplace_back();
+    return states.size()-1;
+  }
+
+  // Thompson construction of the reversed pattern: bytes are consumed from right to left, as in backward search
+  bool build(const Ast &x, long in, long out) {
+    if (states.size() > MAX_STATES) return false;
+    switch (x.type) {
+    case Ast::CLASS: {
+      bitset<AB> cls = x.cls;
+      if (icase)
+        REP(c, AB)
+          if (x.cls[c])
+            cls.set(swap_case(c));
+      if (wide) {
+        // reversed: the high byte is consumed first
+        long t = new_state();
+        states[in].cls.set(0);
+        states[in].next = t;
+        in = t;
+      }
+      states[in].cls = cls;
+      states[in].next = out;
+      return true;
+    }
+    case Ast::CAT: {
+      long cur = in;
+      ROF(i, 0, long(x.kids.size())) {
+        long t = i ? new_state() : out;
+        if (! build(x.kids[i], cur, t)) return false;
+        cur = t;
+      }
+      if (x.kids.empty())
+        states[in].eps.push_back(out);
+      return true;
+    }
+    case Ast::ALT:
+      for (auto &y: x.kids) {
+        long t = new_state();
+        states[in].eps.push_back(t);
+        if (! build(y, t, out)) return false;
+      }
+      return true;
+    case Ast::REPEAT: {
+      long cur = in;
+      REP(i, x.hi) {
+        long t = new_state();
+        if (i >= x.lo)
+          states[cur].eps.push_back(out);
+        if (! build(x.kids[0], cur, t)) return false;
+        cur = t;
+      }
+      states[cur].eps.push_back(out);
+      return true;
+    }
+    }
+    return false;
+  }
+
+  void closure(vector<long> &set) const {
+    vector<bool> seen(states.size());
+    for (long x: set)
+      seen[x] = true;
+    REP(i, set.size())
+      for (long y: states[set[i]].eps)
+        if (! seen[y]) {
+          seen[y] = true;
+          set.push_back(y);
+        }
+    sort(set.begin(), set.end());
+  }
+
+  // depth-first over the intervals of the strings the automaton can consume, with an explicit stack: a repeat may run thousands of
+  // bytes deep. Strings grow to the left, so a match that could be extended to a longer one ending at the same byte is a suffix of it;
+  // the search stops at the shortest, reporting every end position once
+  void search(const FMIndex &fm, vector<long> set, Budget &budget, vector<Match> &res) const {
+    struct Frame {
+      vector<long> set;
+      ulong m, l, h;
+    };
+    vector<Frame> stack, kids;
+    stack.push_back(Frame{move(set), 0, 0, fm.size()});
+    while (stack.size() && budget.step()) {
+      Frame f = move(stack.back());
+      stack.pop_back();
+      bitset<AB> mask;
+      bool accepting = false;
+      for (long x: f.set) {
+        if (x == accept && f.m)
+          accepting = true;
+        if (states[x].next >= 0)
+          mask |= states[x].cls;
+      }
+      if (accepting) {
+        res.push_back(Match{f.l, f.h, f.m, 0});
+        continue;
+      }
+      fm.backward_step(f.m, f.l, f.h, mask, [&](ulong c, ulong l, ulong h) {
+        vector<long> next;
+        for (long x: f.set)
+          if (states[x].next >= 0 && states[x].cls[c])
+            next.push_back(states[x].next);
+        closure(next);
+        kids.push_back(Frame{move(next), f.m+1, l, h});
+      });
+      // reversed, so that children are visited in byte order
+      for (; kids.size(); kids.pop_back())
+        stack.push_back(move(kids.back()));
+    }
+  }
+public:
+  // `icase`: ASCII case-insensitive, `wide`: each byte is followed by \0 (UTF-16LE)
+  bool compile(const string &re, bool icase, bool wide) {
+    Ast x;
+    this->icase = icase;
+    this->wide = wide;
+    p = re.data();
+    end = p+re.size();
+    states.clear();
+    if (! parse_alt(x) || p != end) return false;
+    start = new_state();
+    accept = new_state();
+    return build(x, start, accept);
+  }
+
+  // matching strings with their rows, the shortest one per end position, until `budget` is exhausted
+  void search(const FMIndex &fm, Budget &budget, vector<Match> &res) const {
+    vector<long> set{start};
+    closure(set);
+    search(fm, move(set), budget, res);
+  }
+};
+
+// backtracking search for strings within Hamming or edit distance `k` of a pattern, consumed from its end as in backward search
+// at most `k1` errors are allowed until `phase` bytes of the pattern have been consumed
+class Approx
+{
+  const FMIndex &fm;
+  const string &pattern;
+  bool edit, icase;
+  ulong k, k1, phase;
+  Budget &budget;
+  vector<Match> &res;
+
+  // i bytes of the pattern consumed, e errors, rows [l,h) of a string of length d
+  void search(ulong i, ulong e, ulong d, ulong l, ulong h) {
+    static const bitset<AB> all = bitset<AB>().set();
+    ulong m = pattern.size();
+    if (! budget.step()) return;
+    if (i == m) {
+      res.push_back(Match{l, h, d, e});
+      return;
+    }
+    ulong limit = i < phase ? k1 : k;
+    u8 c = pattern[m-1-i];
+    bitset<AB> same;
+    same.set(c);
+    if (icase)
+      same.set(swap_case(c));
+    if (e == k) {
+      // no errors left: the rest is matched exactly
+      vector<Match> ms{Match{l, h, d, e}}, next;
+      for (; i < m && ms.size(); i++, d++) {
+        bitset<AB> same;
+        same.set(pattern[m-1-i]);
+        if (icase)
+          same.set(swap_case(pattern[m-1-i]));
+        next.clear();
+        for (auto &x: ms)
+          fm.backward_step(d, x.l, x.h, same, [&](ulong, ulong l, ulong h) { next.push_back(Match{l, h, d+1, e}); });
+        swap(ms, next);
+      }
+      res.insert(res.end(), ms.begin(), ms.end());
+      return;
+    }
+    if (edit && i+1 < m && e < limit)
+      search(i+1, e+1, d, l, h); // deletion
+    fm.backward_step(d, l, h, e < limit ? all : same, [&](ulong x, ulong l, ulong h) {
+      search(i+1, e+! same[x], d+1, l, h); // match or substitution
+      if (edit && i > 0 && e < limit)
+        search(i, e+1, d+1, l, h); // insertion
+    });
+  }
+public:
+  Approx(const FMIndex &fm, const string &pattern, bool edit, bool icase, ulong k, ulong k1, ulong phase, Budget &budget, vector<Match> &res)
+    : fm(fm), pattern(pattern), edit(edit), icase(icase), k(k), k1(k1), phase(phase), budget(budget), res(res) {}
+
+  void search() { search(0, 0, 0, 0, fm.size()); }
+};
+
+// occurrences within distance `k` of `pattern`, at most one per position
+//
+// pigeonhole partitioning: if the right half has at most k/2 errors, a backward search of `pattern` in `fm` allowing
+// k/2 errors in the right half finds it; otherwise the left half has at most k/2 errors and a backward search of the
+// reversed pattern in `rfm` finds it. Without `rfm` a single unrestricted backward search is done.
+void approx_hits(const FMIndex &fm, const FMIndex *rfm, const PayloadMap *pmap, const string &pattern, bool edit, bool icase, ulong k, Budget &budget, vector<Hit> &res)
+{
+  ulong m = pattern.size(), n = fm.size();
+  map<ulong, Hit> best;
+  auto add = [&](long pos, const Match &x) {
+    if (pmap && (pos = pmap->to_data(pos, x.len)) < 0) return;
+    auto it = best.find(pos);
+    if (it == best.end() || make_pair(x.dist, x.len) < make_pair(it->second.dist, it->second.len))
+      best[pos] = Hit{ulong(pos), x.len, x.dist};
+  };
+  if (! m) return;
+  vector<Match> matches;
+  Approx(fm, pattern, edit, icase, k, rfm ? k/2 : k, m-m/2, budget, matches).search();
+  for (auto &x: matches)
+    for (ulong l = x.l; l < x.h && budget.step(); l++)
+      add(fm.calc_sa(l), x);
+  if (rfm && k) {
+    string rpattern(pattern.rbegin(), pattern.rend());
+    matches.clear();
+    Approx(*rfm, rpattern, edit, icase, k, k/2, m/2, budget, matches).search();
+    for (auto &x: matches)
+      for (ulong l = x.l; l < x.h && budget.step(); l++)
+        add(n-rfm->calc_sa(l)-x.len, x);
+  }
+  for (auto &x: best)
+    res.push_back(x.second);
+  // `res` may already hold hits of other variants of the pattern
+  sort(res.begin(), res.end(), [](const Hit &x, const Hit &y) {
+    return x.dist != y.dist ? x.dist < y.dist : x.pos < y.pos;
+  });
+}
+
+// trie of reversed patterns, so that patterns sharing a suffix share the backward search steps over it
+class PatternTrie
+{
+  struct Node {
+    map<u8, long> child;
+    vector<long> ids; // patterns ending here
+  };
+  vector<Node> nodes_{Node()};
+public:
+  void insert(const string &pattern, long id) {
+    long x = 0;
+    for (auto it = pattern.rbegin(); it != pattern.rend(); ++it) {
+      auto jt = nodes_[x].child.find(u8(*it));
+      if (jt != nodes_[x].child.end())
+        x = jt->second;
+      else {
+        long y = nodes_.size();
+        nodes_[x].child[u8(*it)] = y;
+        nodes_.emplace_back();
+        x = y;
+      }
+    }
+    nodes_[x].ids.push_back(id);
+  }
+
+  // appends the intervals of pattern `id` to res[id]; a node costs one step of `budget`
+  void search(const FMIndex &fm, bool icase, Budget &budget, vector<vector<Match>> &res) const {
+    // depth-first; node, depth, intervals
+    vector<tuple<long, ulong, vector<Match>>> st;
+    st.emplace_back(0, 0, vector<Match>{Match{0, fm.size(), 0, 0}});
+    while (st.size() && budget.step()) {
+      long x = get<0>(st.back());
+      ulong d = get<1>(st.back());
+      vector<Match> ms = move(get<2>(st.back()));
+      st.pop_back();
+      for (long id: nodes_[x].ids)
+        res[id].insert(res[id].end(), ms.begin(), ms.end());
+      for (auto &ch: nodes_[x].child) {
+        bitset<AB> mask;
+        mask.set(ch.first);
+        if (icase)
+          mask.set(swap_case(ch.first));
+        vector<Match> next;
+        for (auto &y: ms)
+          fm.backward_step(d, y.l, y.h, mask, [&](ulong, ulong l, ulong h) {
+            next.push_back(Match{l, h, d+1, 0});
+          });
+        if (icase)
+          coalesce(next);
+        if (next.size())
+          st.emplace_back(ch.second, d+1, move(next));
+      }
+    }
+  }
+};
+
+// rows of `pattern`, and of its UTF-16LE form with `wide`
+vector<Match> pattern_ranges(const FMIndex &fm, const string &pattern, bool icase, bool wide)
+{
+  vector<Match> res;
+  for (auto &v: wide ? vector<string>{pattern, widen(pattern)} : vector<string>{pattern})
+    if (icase) {
+      auto ms = fm.get_ranges_icase(v.size(), (const u8*)v.c_str());
+      res.insert(res.end(), ms.begin(), ms.end());
+    } else {
+      ulong l, h;
+      tie(l, h) = fm.get_range(v.size(), (const u8*)v.c_str());
+      res.push_back(Match{l, h, v.size(), 0});
+    }
+  return res;
+}
+
+// whether [b, e) contains `pattern`, or its UTF-16LE form with `wide`
+bool contains(const u8 *b, const u8 *e, const string &pattern, bool icase, bool wide)
+{
+  for (auto &v: wide ? vector<string>{pattern, widen(pattern)} : vector<string>{pattern}) {
+    ulong m = v.size();
+    if (! icase) {
+      if (memmem(b, e-b, v.data(), m)) return true;
+      continue;
+    }
+    for (auto p = b; p+m <= e; p++) {
+      ulong i = 0;
+      while (i < m && (p[i] == u8(v[i]) || p[i] == swap_case(v[i])))
+        i++;
+      if (i == m) return true;
+    }
+  }
+  return false;
+}
+
 // serialization
 //
 // http://stackoverflow.com/questions/257288/is-it-possible-to-write-a-c-template-to-check-for-a-functions-existence
@@ -971,7 +1820,7 @@ struct Deserializer
   void align(size_t n) {
     auto o = (uintptr_t)a % n;
     if (o)
-      a = (void*)((uintptr_t)a+o);
+      a = (void*)((uintptr_t)a+n-o);
   }
 
   void skip(size_t n) {
@@ -987,6 +1836,7 @@ void print_help(FILE *fh)
         "Options:\n"
         "  --autocomplete-length %ld\n"
         "  --autocomplete-limit %ld  max number of autocomplete items\n"
+        "  --autocomplete-budget %ld max number of nodes expanded for an autocomplete query in each index\n"
         "  -c, --request-count %ld   max number of requests (default: -1)\n"
         "  -f, --force-rebuild       ignore exsistent indices\n"
         "  --fmindex-sample-rate %lf sample rate of suffix array (for rank -> pos) used in FM index\n"
@@ -996,9 +1846,43 @@ void print_help(FILE *fh)
         "  -o, --oneshot             run only once (no inotify)\n"
         "  -p, --path %s             path of listening Unix domain socket\n"
         "  -r, --recursive           recursive\n"
+        "  --search-budget %ld       max number of nodes visited by a backtracking search (e.g. regex)\n"
+        "  --approx-cpu-limit %lf    max thread CPU seconds of an approximate search\n"
+        "  --approx-max-distance %ld max number of mismatches/edits of an approximate search\n"
+        "  --no-reverse-index        do not build the index of reversed text (autocomplete falls back to sampling)\n"
+        "  --no-payload-index        index whole .ap files, including flow headers, instead of the payloads only\n"
+        "  --context-from-index      extract context and autocomplete bytes from the index rather than the data files\n"
+        "  --pack-file-limit %ld     data files of at most this many bytes are folded into per-directory packs, 0 disables (default: 1048576)\n"
+        "  --pack-min-files %ld      number of small data files of a directory indexed alone that triggers a compaction (default: 16)\n"
+        "  --pack-size-limit %ld     a pack stops taking data files once its members reach this many bytes (default: 268435456)\n"
         "  -s, --data-suffix %s      data file suffix. (default: .ap)\n"
         "  -S, --index-suffix %s     index file suffix. (default: .fm)\n"
         "  -t, --request-timeout %lf clients idle for more than T seconds will be dropped (default: 1)\n"
+        "  --request-size-limit %ld  max number of bytes of a request (default: 1048576)\n"
+        "  --request-threads %ld     number of threads serving requests, pinned to CPUs (default: twice the number of CPUs)\n"
+        "  --request-queue %ld       max number of connections waiting for a thread, others wait in the listen backlog (default: 64)\n"
+        "  --queue-timeout %lf       connections that waited for a thread longer than T seconds are closed unserved (default: 1)\n"
+        "  --frame-path %s           also listen on this Unix domain socket for persistent connections carrying framed requests\n"
+        "  --frame-inflight %ld      max number of concurrent framed requests of a connection (default: 16)\n"
+        "  --tcp-listen %s           also accept requests over TCP on [HOST:]PORT (HOST defaults to 127.0.0.1, IPv6 in brackets)\n"
+        "  --tcp-acceptors %ld       number of threads accepting TCP connections, each on its own SO_REUSEPORT socket (default: number of CPUs)\n"
+        "  --backend %s              coordinate this backend indexer (absolute unix socket path or [HOST:]PORT) instead of indexing; repeat for each shard,\n"
+        "                            in decreasing filename order of the directories they own\n"
+        "  --backend-timeout %lf     seconds a backend may take to answer its part of a request (default: 5)\n"
+        "  --lane-quota %s           max number of threads per request class as class=N,... (classes: autocomplete search count export batch;\n"
+        "                            default: autocomplete all, search half, others a quarter of request-threads)\n"
+        "  --lane-queue %s           max number of requests of a class waiting for a thread, further ones are shed (default: request-queue)\n"
+        "  --lane-deadline %s        seconds a request of a class may run before it returns partial results, 0: none (default: autocomplete=0.05)\n"
+        "  --build-cpus %s           CPUs (e.g. 0-3,8) index builds run on (default: all)\n"
+        "  --request-cpus %s         CPUs request threads are pinned to (default: all)\n"
+        "  --build-nice %ld          niceness of index builds (default: 10)\n"
+        "  --build-ioprio %s         best-effort IO priority level 0-7 of index builds, or idle (default: 7)\n"
+        "  --throttle-p99 %lf        halve concurrent index builds, down to none, while the p99 latency of autocomplete and search requests\n"
+        "                            exceeds T seconds, 0 disables (default: 0)\n"
+        "  --batch-threads %ld       number of threads evaluating a batch query (default: indexer-limit)\n"
+        "  --left-context %ld        bytes of context before a hit (modifier c, autocomplete) (default: 50)\n"
+        "  --right-context %ld       bytes of context after a hit (modifier c, autocomplete) (default: 30)\n"
+        "  --aggregate-sample %ld    max number of hits located by an aggregation query (modifier g), others are estimated (default: 65536)\n"
         "  -h, --help                display this help and exit\n"
         "\n"
         "Examples:\n"
@@ -1006,30 +1890,208 @@ void print_help(FILE *fh)
         "  zsh0: ./indexer /tmp/ray # build index and watch changes within /tmp/ray, creating indices upon CLOSE_WRITE after CREATE/MODIFY, and MOVED_TO, removing indices upon DELETE and MOVED_FROM\n"
         "  zsh1: print -rn -- $'\\0\\0\\0haystack' | socat -t 60 - /tmp/search.sock # autocomplete\n"
         "  zsh1: print -rn -- $'3\\0\\0\\0haystack' | socat -t 60 - /tmp/search.sock # search, skip first 3 matches\n"
+        "  zsh1: print -rn -- $'0r\\0\\0\\0flag\\{[0-9a-f]{8}\\}' | socat -t 60 - /tmp/search.sock # search with byte classes and bounded repeats\n"
         "  zsh1: print -rn -- $'5\\0a\\0b\\0ha\\0stack\\0\\\\0\\\\1' | socat -t 60 - /tmp/search.sock # search filenames F satisfying (\"a\" <= F <= \"b\"), skip first 5, pattern is \"stack\\0\\0\\1\". \\-escape is allowed\n"
         , fh);
   exit(fh == stdout ? 0 : EX_USAGE);
 }
 
+// parses `class=value,...`, calling set(class, value)
+void get_lane_values(const char *arg, function<void(long, const char*)> set)
+{
+  string s = arg;
+  for (size_t i = 0, j; i <= s.size(); i = j+1) {
+    if ((j = s.find(',', i)) == string::npos)
+      j = s.size();
+    string item = s.substr(i, j-i);
+    size_t eq = item.find('=');
+    long lane = 0;
+    while (lane < N_LANES && item.compare(0, eq, lane_names[lane]))
+      lane++;
+    if (eq == string::npos || lane == N_LANES)
+      err_exit(EX_USAGE, "unknown request class: %s", item.c_str());
+    set(lane, item.c_str()+eq+1);
+  }
+}
+
+// restricts hits to flows (start time, ports, addresses) and packets (direction); every given field has to match
+struct FlowFilter
+{
+  bool active = false;
+  long since = LONG_MIN, until = LONG_MAX, dir = -1;
+  long port = -1, client_port = -1, server_port = -1;
+  long ip = -1, client_ip = -1, server_ip = -1;
+  string file_begin, file_end; // requested range of data files, which members of a pack may straddle
+
+  // space-separated key=value; a negative since/until is relative to now
+  bool parse(const char *str) {
+    for (;;) {
+      while (*str == ' ') str++;
+      if (! *str) return true;
+      const char *eq = strchr(str, '='), *end = strchr(str, ' ');
+      if (! end) end = str+strlen(str);
+      if (! eq || eq > end) return false;
+      string key(str, eq), val(eq+1, end);
+      char *e;
+      errno = 0;
+      long x = strtol(val.c_str(), &e, 10);
+      bool number = val.size() && ! *e && ! errno;
+      active = true;
+      if (key == "since" || key == "until") {
+        if (! number) return false;
+        (key == "since" ? since : until) = x < 0 ? time(NULL)+x : x;
+      } else if (key == "port" || key == "cport" || key == "sport") {
+        if (! number || x < 0 || x > 65535) return false;
+        (key == "port" ? port : key == "cport" ? client_port : server_port) = x;
+      } else if (key == "ip" || key == "cip" || key == "sip") {
+        in_addr addr;
+        if (inet_pton(AF_INET, val.c_str(), &addr) != 1) return false;
+        (key == "ip" ? ip : key == "cip" ? client_ip : server_ip) = ntohl(addr.s_addr);
+      } else if (key == "dir") {
+        if (val == "c" || val == "client") dir = 0;
+        else if (val == "s" || val == "server") dir = 1;
+        else return false;
+      } else
+        return false;
+      str = end;
+    }
+  }
+
+  bool match(const FlowHeader &f) const {
+    auto &k = f.key;
+    return since <= f.unix_time && f.unix_time <= until &&
+      (port < 0 || k.client_port == port || k.server_port == port) &&
+      (client_port < 0 || k.client_port == client_port) &&
+      (server_port < 0 || k.server_port == server_port) &&
+      (ip < 0 || k.client_ip == ip || k.server_ip == ip) &&
+      (client_ip < 0 || k.client_ip == client_ip) &&
+      (server_ip < 0 || k.server_ip == server_ip);
+  }
+
+  // the hit [pos, pos+len) lies in the payload of a matching flow, in a packet of the given direction
+  bool match(const ApFile &ap, ulong pos, ulong len) const {
+    long i = ap.flow_of(pos, len);
+    return i >= 0 && match(*ap.flow(i)) && (dir < 0 || ap.flow(i)->packets[ap.packet_of(i, pos)].from_server == dir);
+  }
+};
+
+// flow metadata of .ap files, used to skip files that cannot match a FlowFilter
+struct FlowSummary
+{
+  long min_time = LONG_MAX, max_time = LONG_MIN;
+  vector<u16> client_ports, server_ports; // sorted
+  vector<u32> client_ips, server_ips; // sorted
+
+  template<typename T>
+  static void sort_unique(vector<T> &xs) {
+    sort(xs.begin(), xs.end());
+    xs.erase(unique(xs.begin(), xs.end()), xs.end());
+    xs.shrink_to_fit();
+  }
+
+  void add(const ApFile &ap) {
+    REP(i, ap.n_flows()) {
+      auto &f = *ap.flow(i);
+      min_time = min(min_time, long(f.unix_time));
+      max_time = max(max_time, long(f.unix_time));
+      client_ports.push_back(f.key.client_port);
+      server_ports.push_back(f.key.server_port);
+      client_ips.push_back(f.key.client_ip);
+      server_ips.push_back(f.key.server_ip);
+    }
+    sort_unique(client_ports);
+    sort_unique(server_ports);
+    sort_unique(client_ips);
+    sort_unique(server_ips);
+  }
+
+  bool may_match(const FlowFilter &f) const {
+    auto has_port = [](const vector<u16> &ports, long port) { return binary_search(ports.begin(), ports.end(), u16(port)); };
+    auto has_ip = [](const vector<u32> &ips, long ip) { return binary_search(ips.begin(), ips.end(), u32(ip)); };
+    return min_time <= max_time && f.since <= max_time && min_time <= f.until &&
+      (f.port < 0 || has_port(client_ports, f.port) || has_port(server_ports, f.port)) &&
+      (f.client_port < 0 || has_port(client_ports, f.client_port)) &&
+      (f.server_port < 0 || has_port(server_ports, f.server_port)) &&
+      (f.ip < 0 || has_ip(client_ips, f.ip) || has_ip(server_ips, f.ip)) &&
+      (f.client_ip < 0 || has_ip(client_ips, f.client_ip)) &&
+      (f.server_ip < 0 || has_ip(server_ips, f.server_ip));
+  }
+};
+
+// an index file and the data files whose concatenation it indexes: a single data file, or a pack of small data files
 struct Entry
 {
-  FILE* index_fh;
-  int data_fd, index_fd;
-  off_t data_size, index_size;
-  void *data_mmap, *index_mmap;
-  FMIndex *fm;
+  FILE* index_fh = nullptr;
+  int index_fd = -1;
+  off_t index_size = 0;
+  void *index_mmap = MAP_FAILED;
+  string index_path;
+  FMIndex *fm = nullptr, *rfm = nullptr;
+  PayloadMap *pmap = nullptr; // null if the whole data file is indexed
+  vector<unique_ptr<Doc>> docs; // sorted by path
+  EliasFano doc_begin; // of a pack: begin of each member
+  FlowSummary flows; // of all members
   ~Entry() {
     delete fm;
-    munmap(data_mmap, data_size);
-    munmap(index_mmap, index_size);
-    close(data_fd);
+    delete rfm;
+    delete pmap;
+    if (index_mmap != MAP_FAILED)
+      munmap(index_mmap, index_size);
     if (index_fh)
       fclose(index_fh);
-    else
+    else if (index_fd >= 0)
       close(index_fd);
   }
+
+  bool pack() const { return docs.size() > 1; }
+  off_t data_size() const {
+    off_t s = 0;
+    for (auto &d: docs)
+      s += d->size;
+    return s;
+  }
+  // some member lies within / all members lie within [lo, hi]
+  bool overlaps(const string &lo, const string &hi) const { return lo <= docs.back()->path && docs[0]->path <= hi; }
+  bool within(const string &lo, const string &hi) const { return lo <= docs[0]->path && docs.back()->path <= hi; }
+
+  // the member containing data offset `off`
+  ulong doc_index(ulong off) const { return pack() ? doc_begin.rank(off+1)-1 : 0; }
+  const Doc &doc_of(ulong off) const { return *docs[doc_index(off)]; }
+
+  // flows are identified across the members by member index << 32 | flow index
+  long flow_of(ulong pos, ulong len) const {
+    ulong d = doc_index(pos);
+    long i = docs[d]->ap.flow_of(pos-docs[d]->begin, len);
+    return i < 0 ? -1 : long(d) << 32 | i;
+  }
+  const Doc &flow_doc(long f) const { return *docs[f >> 32]; }
+  const FlowHeader *flow(long f) const { return flow_doc(f).ap.flow(u32(f)); }
+  off_t payload_begin(long f) const { return flow_doc(f).begin+flow_doc(f).ap.payload_begin(u32(f)); }
+  off_t flow_end(long f) const { return flow_doc(f).begin+flow_doc(f).ap.flow_end(u32(f)); }
+
+  // data offset of the occurrence [pos, pos+len) found in the index, -1 if it spans two payloads
+  long data_pos(ulong pos, ulong len) const {
+    return pmap ? pmap->to_data(pos, len) : pos;
+  }
+
+  // data bytes [off, off+len), which lie in one payload; with --context-from-index extracted from the index rather than read from the data file
+  string bytes(ulong off, ulong len) const {
+    if (opt_context_from_index)
+      return fm->extract(pmap ? pmap->to_text(off) : off, len);
+    auto &d = doc_of(off);
+    string buf;
+    len = min(len, d.begin+d.length-off);
+    auto b = d.bytes(off-d.begin, len, buf);
+    return d.ap.compressed() ? buf : string((const char *)b, len);
+  }
 };
 
+long index_flags()
+{
+  return INDEX_VERSION << 16 | (opt_reverse_index ? INDEX_REVERSE : 0) | (opt_payload_index ? INDEX_PAYLOAD : 0) |
+    (opt_context_from_index ? INDEX_ISA : 0);
+}
+
 string data_to_index(const string& path)
 {
   return path+index_suffix;
@@ -1040,6 +2102,24 @@ bool is_data(const string &path)
   return path.size() >= data_suffix.size() && path.substr(path.size()-data_suffix.size()) == data_suffix;
 }
 
+// index file of a pack: .<first member><pack_suffix>, hidden
+string pack_suffix()
+{
+  return ".pack"+index_suffix;
+}
+
+bool is_pack(const string &name)
+{
+  string suffix = pack_suffix();
+  return name.size() > suffix.size() && name[0] == '.' && name.substr(name.size()-suffix.size()) == suffix;
+}
+
+string dir_of(const string &path)
+{
+  auto i = path.rfind('/');
+  return i == string::npos ? "." : path.substr(0, i);
+}
+
 string to_path(string path, string name)
 {
   if (! (path.size() && path.back() == '/'))
@@ -1050,7 +2130,217 @@ string to_path(string path, string name)
   return path;
 }
 
-template<> vector<RefCountTreap<string, shared_ptr<Entry>>::Node*> RefCountTreap<string, shared_ptr<Entry>>::roots{};
+///// flows
+
+// scanning about this many bytes of payload costs as much as locating one suffix array row
+const ulong SCAN_BYTES_PER_ROW = 4096;
+
+// hits of `entry` have to be checked one by one: a flow filter is active, or a member of the pack lies outside of the requested range
+bool restricted(const Entry &entry, const FlowFilter &filter)
+{
+  return filter.active || ! entry.within(filter.file_begin, filter.file_end);
+}
+
+// the hit [pos, pos+len) lies in a member within the requested range and passes the flow filter
+bool hit_matches(const Entry &entry, const FlowFilter &filter, ulong pos, ulong len)
+{
+  auto &d = entry.doc_of(pos);
+  return filter.file_begin <= d.path && d.path <= filter.file_end && (! filter.active || filter.match(d.ap, pos-d.begin, len));
+}
+
+struct FlowTerm
+{
+  string pattern;
+  bool negated;
+};
+
+// flows of `entry` whose payload contains all positive terms and no negated term, each with the first occurrence of the rarest positive term
+// terms are evaluated from the rarest; each one either locates all its occurrences and maps them to flow ids, or scans the payload of the remaining
+// candidate flows, whichever is estimated to be cheaper
+void flow_query(const Entry &entry, const vector<FlowTerm> &terms, bool icase, bool wide, const FlowFilter &filter, Budget &budget, vector<pair<long, Hit>> &res)
+{
+  auto &fm = *entry.fm;
+  bool check = restricted(entry, filter);
+  struct Term {
+    const FlowTerm *term;
+    vector<Match> matches;
+    ulong count;
+  };
+  vector<Term> ts;
+  for (auto &t: terms) {
+    Term x{&t, pattern_ranges(fm, t.pattern, icase, wide), 0};
+    for (auto &m: x.matches)
+      x.count += m.h-m.l;
+    if (! x.count && ! t.negated) return;
+    if (x.count)
+      ts.push_back(move(x));
+  }
+  // positive terms first, rarest first
+  sort(ts.begin(), ts.end(), [](const Term &x, const Term &y) {
+    return x.term->negated != y.term->negated ? y.term->negated : x.count < y.count;
+  });
+  if (ts.empty() || ts[0].term->negated) return;
+
+  // sorted flow ids -> first occurrence
+  map<long, Hit> cand;
+  for (auto &m: ts[0].matches)
+    for (ulong l = m.l; l < m.h && budget.step(); l++) {
+      long pos = entry.data_pos(fm.calc_sa(l), m.len);
+      long f = pos < 0 ? -1 : entry.flow_of(pos, m.len);
+      if (f < 0 || check && ! hit_matches(entry, filter, pos, m.len)) continue;
+      auto it = cand.find(f);
+      if (it == cand.end() || pos < it->second.pos)
+        cand[f] = Hit{ulong(pos), m.len, 0};
+    }
+  FOR(i, 1, ts.size()) {
+    if (cand.empty() || budget.exhausted()) break;
+    auto &t = ts[i];
+    ulong bytes = 0;
+    for (auto &c: cand)
+      bytes += entry.flow_end(c.first)-entry.payload_begin(c.first);
+    vector<long> flows;
+    bool scan = bytes < t.count*SCAN_BYTES_PER_ROW;
+    if (scan)
+      budget.work -= bytes/SCAN_BYTES_PER_ROW;
+    else {
+      for (auto &m: t.matches)
+        for (ulong l = m.l; l < m.h && budget.step(); l++) {
+          long pos = entry.data_pos(fm.calc_sa(l), m.len),
+               f = pos < 0 ? -1 : entry.flow_of(pos, m.len);
+          if (f >= 0)
+            flows.push_back(f);
+        }
+      sort(flows.begin(), flows.end());
+    }
+    string buf;
+    for (auto it = cand.begin(); it != cand.end(); ) {
+      auto &d = entry.flow_doc(it->first);
+      off_t n = entry.flow_end(it->first)-entry.payload_begin(it->first);
+      auto b = scan ? d.bytes(entry.payload_begin(it->first)-d.begin, n, buf) : nullptr;
+      bool found = scan
+        ? contains(b, b+n, t.term->pattern, icase, wide)
+        : binary_search(flows.begin(), flows.end(), it->first);
+      if (found == t.term->negated)
+        it = cand.erase(it);
+      else
+        ++it;
+    }
+  }
+  for (auto &c: cand)
+    res.emplace_back(c.first, c.second);
+}
+
+// FMIndex::locate restricted to hits passing `filter` (see hit_matches); every row has to be located to count them
+ulong locate_filtered(const Entry &entry, const FlowFilter &filter, const vector<Match> &matches, ulong limit, ulong &skip, Budget &budget, vector<Hit> &res)
+{
+  ulong total = 0;
+  for (auto &x: matches)
+    for (ulong l = x.l; l < x.h && budget.step(); l++) {
+      long pos = entry.data_pos(entry.fm->calc_sa(l), x.len);
+      if (pos < 0 || ! hit_matches(entry, filter, pos, x.len)) continue;
+      total++;
+      if (skip)
+        skip--;
+      else if (res.size() < limit)
+        res.push_back(Hit{ulong(pos), x.len, x.dist});
+    }
+  return total;
+}
+
+// hit counts grouped by server port, client address and minute of the flow start; hits outside of flows are only counted in `hits`
+struct Histograms
+{
+  double hits = 0;
+  map<long, double> server_ports, client_ips, minutes;
+
+  void add(const FlowHeader *f, double weight) {
+    hits += weight;
+    if (! f) return;
+    server_ports[f->key.server_port] += weight;
+    client_ips[f->key.client_ip] += weight;
+    minutes[f->unix_time/60*60] += weight;
+  }
+
+  void merge(const Histograms &o) {
+    hits += o.hits;
+    for (auto &x: o.server_ports) server_ports[x.first] += x.second;
+    for (auto &x: o.client_ips) client_ips[x.first] += x.second;
+    for (auto &x: o.minutes) minutes[x.first] += x.second;
+  }
+};
+
+// locates a fraction `rate` of the rows of each interval, evenly spaced, each standing for rows/located hits
+void aggregate_hits(const Entry &entry, const FlowFilter &filter, const vector<Match> &matches, double rate, Budget &budget, Histograms &res)
+{
+  bool check = restricted(entry, filter);
+  for (auto &x: matches) {
+    ulong rows = x.h-x.l, k = min(rows, ulong(ceil(rows*rate)));
+    double weight = double(rows)/k;
+    for (ulong i = 0; i < k && budget.step(); i++) {
+      long pos = entry.data_pos(entry.fm->calc_sa(x.l+i*rows/k), x.len);
+      if (pos < 0) continue;
+      if (check && ! hit_matches(entry, filter, pos, x.len)) continue;
+      long f = entry.flow_of(pos, x.len);
+      res.add(f >= 0 ? entry.flow(f) : nullptr, weight);
+    }
+  }
+}
+
+// columns appended to a hit: epoch, client port, server port, direction (c/s), [begin, end) of the packet, HTML context; -1 and empty if unknown
+// binary: 0 if unknown, else 1 and varints of the same fields, the direction byte, then the offset of the hit in the context and the raw context
+string hit_metadata(const Entry &entry, ulong pos, ulong len, bool binary = false)
+{
+  auto &d = entry.doc_of(pos);
+  auto &ap = d.ap;
+  pos -= d.begin;
+  long i = ap.flow_of(pos, len);
+  if (i < 0)
+    return binary ? string(1, '\0') : "\t-1\t-1\t-1\t\t-1\t-1\t";
+  auto f = ap.flow(i);
+  auto &p = f->packets[ap.packet_of(i, pos)];
+  off_t lo = max(off_t(pos)-left_context, ap.payload_begin(i)), hi = min(off_t(pos+len)+right_context, ap.flow_end(i));
+  string window = entry.bytes(d.begin+lo, hi-lo);
+  if (binary) {
+    string ret(1, '\1');
+    for (ulong x: {ulong(u32(f->unix_time)), ulong(u16(f->key.client_port)), ulong(u16(f->key.server_port))})
+      put_varint(ret, x);
+    ret += p.from_server ? 's' : 'c';
+    for (ulong x: {ulong(p.ap_offset), ulong(p.ap_offset+p.len), ulong(pos-lo), ulong(window.size())})
+      put_varint(ret, x);
+    return ret += window;
+  }
+  char buf[BUF_SIZE];
+  snprintf(buf, sizeof buf, "\t%" PRIu32 "\t%" PRIu16 "\t%" PRIu16 "\t%c\t%ld\t%ld\t", u32(f->unix_time), u16(f->key.client_port), u16(f->key.server_port),
+           p.from_server ? 's' : 'c', long(p.ap_offset), long(p.ap_offset+p.len));
+  string ret = buf;
+  ap.context(i, pos, len, left_context, right_context, ret, (const u8 *)window.data(), lo);
+  return ret;
+}
+
+// records of a binary response (modifier x); a filename is sent with its first reference, later ones use its index
+struct BinaryResponse
+{
+  enum { SUGGESTION = 's', HIT = 'h', TOTAL = 't', GROUP = 'g', ERROR = 'e' };
+  enum { LOWER_BOUND = 1, ESTIMATE = 2 };
+  BufferedWriter &out;
+  map<string, ulong> files;
+
+  explicit BinaryResponse(BufferedWriter &out) : out(out) {}
+  BinaryResponse& byte(int x) { out.buf += char(x); return *this; }
+  BinaryResponse& varint(ulong x) { put_varint(out.buf, x); return *this; }
+  BinaryResponse& raw(const string &x) { out.buf += x; return *this; }
+  BinaryResponse& bytes(const string &x) { return varint(x.size()).raw(x); }
+  // index, followed by the name if it is new to this response (index == number of names seen)
+  BinaryResponse& file(const string &path) {
+    auto it = files.find(path);
+    if (it != files.end())
+      return varint(it->second);
+    varint(files.size());
+    files.emplace(path, files.size());
+    return bytes(path);
+  }
+  bool end() { return out.maybe_flush(); }
+};
 
 namespace Server
 {
@@ -1064,7 +2354,104 @@ namespace Server
                  pending_empty = PTHREAD_COND_INITIALIZER;
   bool manager_quit = false;
   vector<string> indexer_tasks;
-  RefCountTreap<string, shared_ptr<Entry>> loaded;
+  Catalog<shared_ptr<Entry>> loaded;
+  map<string, set<string>> small_files; // directory -> data files of at most pack_file_limit bytes indexed alone
+  map<string, set<string>> packs; // directory -> keys of its packs
+  map<string, string> packed; // member -> key of its pack
+  set<string> packing; // directories being compacted
+  WorkerPool pool;
+  long lane_ids[N_LANES]; // pool lane of each request class
+  atomic<long> backend_failures{0};
+  long build_slots; // builds allowed to run at once, lowered from indexer_limit by the throttle
+  set<long> build_tids; // threads building an index or a pack
+  set<long> idle_tids; // build threads in SCHED_IDLE, including those the throttle failed to move back
+  double throttle_at = 0; // when the throttle looks at the latencies again
+
+  // latencies of autocomplete and search requests since the throttle last looked at them
+  struct Latencies {
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    vector<double> window;
+    atomic<double> p99{0}; // of the last window with requests
+    void add(double x) {
+      pthread_mutex_lock(&mutex);
+      if (window.size() < 1 << 14)
+        window.push_back(x);
+      pthread_mutex_unlock(&mutex);
+    }
+    // closes the window; false if no request completed in it
+    bool roll() {
+      vector<double> w;
+      pthread_mutex_lock(&mutex);
+      w.swap(window);
+      pthread_mutex_unlock(&mutex);
+      if (w.empty()) return false;
+      auto it = w.begin()+(w.size()-1)*99/100;
+      nth_element(w.begin(), it, w.end());
+      p99 = *it;
+      return true;
+    }
+  } latencies;
+
+  // with `mutex` held. SCHED_IDLE runs a build only on otherwise idle CPUs; leaving it may need privileges (RLIMIT_NICE or
+  // CAP_SYS_NICE), a build failing to leave it stays in idle_tids and runs slowed until it finishes
+  void set_build_policy(long tid, bool idle) {
+    sched_param param = {};
+    if (sched_setscheduler(tid, idle ? SCHED_IDLE : SCHED_OTHER, &param) < 0) {
+      err_msg("failed to move build thread %ld to %s", tid, idle ? "SCHED_IDLE" : "SCHED_OTHER");
+      return;
+    }
+    if (idle)
+      idle_tids.insert(tid);
+    else
+      idle_tids.erase(tid);
+  }
+
+  // applies the build CPU set, niceness and IO priority to the calling thread and registers it with the throttle
+  void build_thread_begin() {
+    int saved = errno;
+    long tid = syscall(SYS_gettid);
+    if (build_cpus.size()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (int cpu: build_cpus)
+        CPU_SET(cpu, &set);
+      if (sched_setaffinity(0, sizeof set, &set) < 0)
+        err_msg("sched_setaffinity");
+    }
+    if (build_nice && setpriority(PRIO_PROCESS, tid, build_nice) < 0)
+      err_msg("setpriority");
+    // IOPRIO_WHO_PROCESS, IOPRIO_CLASS_BE or IOPRIO_CLASS_IDLE in the top bits
+    if (syscall(SYS_ioprio_set, 1, tid, build_ioprio < 0 ? 3 << 13 : 2 << 13 | build_ioprio) < 0)
+      err_msg("ioprio_set");
+    pthread_mutex_lock(&mutex);
+    build_tids.insert(tid);
+    if (build_slots < indexer_limit)
+      set_build_policy(tid, true);
+    pthread_mutex_unlock(&mutex);
+    errno = saved;
+  }
+
+  // with `mutex` held
+  void build_thread_end() {
+    long tid = syscall(SYS_gettid);
+    build_tids.erase(tid);
+    idle_tids.erase(tid);
+  }
+
+  // with `mutex` held, once a second: while the p99 latency of autocomplete and search requests exceeds throttle_p99, halves the build
+  // slots (0 pauses builds) and moves running builds to SCHED_IDLE; otherwise gives a slot back
+  void throttle() {
+    double now = monotonic_time();
+    if (throttle_p99 <= 0 || now < throttle_at) return;
+    throttle_at = now+1;
+    long slots = latencies.roll() && latencies.p99 > throttle_p99 ? build_slots/2 : min(build_slots+1, indexer_limit);
+    if (slots == build_slots) return;
+    if ((slots < indexer_limit) != (build_slots < indexer_limit))
+      for (long tid: build_tids)
+        set_build_policy(tid, slots < indexer_limit);
+    log_status("build throttle: %ld of %ld slots, query p99 %.3lf s", slots, indexer_limit, latencies.p99.load());
+    build_slots = slots;
+  }
 
   void detached_thread(void* (*start_routine)(void*), void* data) {
     pending++;
@@ -1090,42 +2477,144 @@ namespace Server
     return wd;
   }
 
+  // with `mutex` held once the manager runs
   void add_data(const string& data_path) {
     indexer_tasks.push_back(data_path);
     pthread_cond_signal(&manager_cond);
   }
 
+  // the following maintain `loaded` and the bookkeeping of packs, with `mutex` held
+
+  // an entry is keyed by its last member and covers the paths from its first member
+  void load(const shared_ptr<Entry>& entry) {
+    string key = entry->docs.back()->path, dir = dir_of(key);
+    if (entry->pack()) {
+      packs[dir].insert(key);
+      for (auto& d: entry->docs)
+        packed[d->path] = key;
+    } else if (entry->docs[0]->size <= pack_file_limit)
+      small_files[dir].insert(key);
+    loaded.insert(entry->docs[0]->path, key, entry);
+    pthread_cond_signal(&manager_cond);
+  }
+
+  void unload(const string& key) {
+    auto x = loaded.find(key);
+    if (! x) return;
+    auto entry = *x;
+    string dir = dir_of(key);
+    loaded.erase(key);
+    pthread_cond_signal(&manager_cond);
+    if (entry->pack()) {
+      packs[dir].erase(key);
+      for (auto& d: entry->docs)
+        packed.erase(d->path);
+    } else
+      small_files[dir].erase(key);
+  }
+
+  // drops a pack and indexes its members alone, except `except`
+  void dissolve(const string& key, const string& except) {
+    auto x = loaded.find(key);
+    if (! x) return;
+    auto entry = *x;
+    unload(key);
+    if (! unlink(entry->index_path.c_str()))
+      log_action("unlinked %s", entry->index_path.c_str());
+    for (auto& d: entry->docs)
+      if (d->path != except)
+        add_data(d->path);
+  }
+
   void rm_data(const string& data_path) {
     string index_path = data_to_index(data_path);
     if (! unlink(index_path.c_str()))
       log_action("unlinked %s", index_path.c_str());
     else if (errno != ENOENT)
       err_msg("failed to unlink %s", index_path.c_str());
-    if (loaded.find(data_path)) {
-      loaded.erase(data_path);
+    pthread_mutex_lock(&mutex);
+    if (packed.count(data_path)) {
+      log_action("dissolving the pack of %s", data_path.c_str());
+      dissolve(packed[data_path], data_path);
+    } else if (loaded.find(data_path)) {
+      unload(data_path);
       log_action("unloaded index of %s", data_path.c_str());
     }
+    pthread_mutex_unlock(&mutex);
+  }
+
+  // FM-indices of the concatenation of `docs`, then for a payload-only index or a pack the map of text positions to data offsets
+  void write_indices(Serializer& ar, const vector<unique_ptr<Doc>>& docs, off_t flags) {
+    const u8 *text;
+    ulong text_size;
+    vector<u8> buf;
+    string whole;
+    PayloadMap pmap;
+    if (flags & (INDEX_PAYLOAD | INDEX_PACK)) {
+      for (auto& d: docs)
+        pmap.add(*d, flags & INDEX_PAYLOAD, buf);
+      pmap.finish(docs.back()->begin+docs.back()->length);
+      text = buf.data();
+      text_size = buf.size();
+    } else {
+      // a compressed .ap is indexed as its decompressed contents
+      text = docs[0]->bytes(0, docs[0]->length, whole);
+      text_size = docs[0]->length;
+    }
+    {
+      FMIndex fm;
+      fm.init(text_size, text, fmindex_sample_rate, flags & INDEX_ISA);
+      ar & fm;
+    }
+    if (flags & INDEX_REVERSE) {
+      u8 *rtext = new u8[text_size];
+      reverse_copy(text, text+text_size, rtext);
+      FMIndex rfm;
+      rfm.init(text_size, rtext, fmindex_sample_rate, false);
+      delete[] rtext;
+      ar & rfm;
+    }
+    if (flags & (INDEX_PAYLOAD | INDEX_PACK))
+      ar & pmap;
+  }
+
+  void read_indices(Deserializer& ar, Entry& entry, off_t flags) {
+    for (auto& d: entry.docs) {
+      entry.flows.add(d->ap);
+      // only headers are read from the data file, don't read ahead into payloads
+      if (opt_context_from_index && d->size > 0)
+        madvise(d->mmap, d->size, MADV_RANDOM);
+    }
+    entry.fm = new FMIndex;
+    ar & *entry.fm;
+    if (flags & INDEX_REVERSE) {
+      entry.rfm = new FMIndex;
+      ar & *entry.rfm;
+    }
+    if (flags & (INDEX_PAYLOAD | INDEX_PACK)) {
+      entry.pmap = new PayloadMap;
+      ar & *entry.pmap;
+    }
   }
 
   void* indexer(void* data_path_) {
+    build_thread_begin();
     string* data_path = (string*)data_path_;
     string index_path = data_to_index(*data_path);
-    int data_fd = -1, index_fd = -1;
+    int index_fd = -1;
     off_t data_size, index_size;
-    void *data_mmap = MAP_FAILED, *index_mmap = MAP_FAILED;
-    bool rebuild = true;
+    void *index_mmap = MAP_FAILED;
+    vector<unique_ptr<Doc>> docs;
     FILE* fh = NULL;
     errno = 0;
-    if ((data_fd = open(data_path->c_str(), O_RDONLY)) < 0)
-      goto quit;
-    if ((data_size = lseek(data_fd, 0, SEEK_END)) < 0)
-      goto quit;
-    if (data_size > 0 && (data_mmap = mmap(NULL, data_size, PROT_READ, MAP_SHARED, data_fd, 0)) == MAP_FAILED)
+    docs.emplace_back(new Doc);
+    if (! docs[0]->open(*data_path))
       goto quit;
+    data_size = docs[0]->size;
     if ((index_fd = open(index_path.c_str(), O_RDWR | O_CREAT, 0666)) < 0)
       goto quit;
     {
-      off_t buf[2];
+      off_t buf[3];
       int nread;
       if ((nread = read(index_fd, buf, sizeof buf)) < 0)
         goto quit;
@@ -1135,16 +2624,20 @@ namespace Server
         log_status("index file %s: bad magic, rebuilding", index_path.c_str());
       else if (nread < 2*sizeof(off_t) || buf[1] != data_size)
         log_status("index file %s: mismatching length of data file, rebuilding", index_path.c_str());
-      else if ((index_size = lseek(index_fd, 0, SEEK_END)) < 2*sizeof(off_t))
+      else if (nread < 3*sizeof(off_t) || buf[2] != index_flags())
+        log_status("index file %s: mismatching index options, rebuilding", index_path.c_str());
+      else if ((index_size = lseek(index_fd, 0, SEEK_END)) < 3*sizeof(off_t))
         ;
       else if (! opt_force_rebuild)
         goto load;
     }
     // rebuild
-    if (loaded.find(*data_path)) {
-      loaded.erase(*data_path);
+    pthread_mutex_lock(&mutex);
+    if (! packed.count(*data_path) && loaded.find(*data_path)) {
+      unload(*data_path);
       log_action("rebuilding index of '%s", data_path->c_str());
     }
+    pthread_mutex_unlock(&mutex);
     {
       StopWatch sw;
       if (! (fh = fdopen(index_fd, "w")))
@@ -1155,10 +2648,12 @@ namespace Server
         err_exit(EX_IOERR, "fwrite");
       if (fwrite(MAGIC_BAD, sizeof(off_t), 1, fh) != 1) // length of origin
         err_exit(EX_IOERR, "fwrite");
+      off_t flags = index_flags();
+      if (fwrite(&flags, sizeof(off_t), 1, fh) != 1)
+        err_exit(EX_IOERR, "fwrite");
       Serializer ar(fh);
-      FMIndex fm;
-      fm.init(data_size, (const u8 *)data_mmap, fmindex_sample_rate);
-      ar & fm;
+      // payload-only: the payloads of the flows of a .ap file, followed by the map to data offsets
+      write_indices(ar, docs, flags);
       index_size = ftello(fh);
       if (ftruncate(index_fd, index_size) < 0)
         err_exit(EX_IOERR, "ftruncate");
@@ -1176,20 +2671,23 @@ load:
     {
       if ((index_mmap = mmap(NULL, index_size, PROT_READ, MAP_SHARED, index_fd, 0)) == MAP_FAILED)
         goto quit;
-      Deserializer ar((u8*)index_mmap+2*sizeof(off_t));
+      Deserializer ar((u8*)index_mmap+3*sizeof(off_t));
       auto entry = make_shared<Entry>();
-      entry->data_fd = data_fd;
       entry->index_fd = index_fd;
       entry->index_fh = fh;
-      entry->data_size = data_size;
       entry->index_size = index_size;
-      entry->data_mmap = data_mmap;
       entry->index_mmap = index_mmap;
-      entry->fm = new FMIndex;
-      ar & *entry->fm;
+      entry->index_path = index_path;
+      entry->docs = move(docs);
+      read_indices(ar, *entry, index_flags());
       pthread_mutex_lock(&mutex);
-      loaded.insert(*data_path, entry);
-      pthread_cond_signal(&manager_cond);
+      // newer than its copy in a pack
+      if (packed.count(*data_path)) {
+        log_action("dissolving the pack of %s", data_path->c_str());
+        dissolve(packed[*data_path], *data_path);
+      }
+      unload(*data_path);
+      load(entry);
       pthread_mutex_unlock(&mutex);
       log_action("loaded index of %s", data_path->c_str());
     }
@@ -1199,29 +2697,228 @@ quit:
       fclose(fh);
     else if (index_fd >= 0)
       close(index_fd);
-    if (data_mmap != MAP_FAILED)
-      munmap(data_mmap, data_size);
-    if (data_fd >= 0)
-      close(data_fd);
 success:
     delete data_path;
     if (errno)
       err_msg("failed to index %s", data_path->c_str());
     pthread_mutex_lock(&mutex);
+    build_thread_end();
+    pending--;
+    pending_indexers--;
+    pthread_cond_signal(&manager_cond);
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+  }
+
+  // entry of the pack index file `index_path`, null unless it is complete and its members are unchanged
+  // layout: header (magic, total size of the members, flags), sizes and NUL-terminated names of the members (relative to the directory of
+  // the pack), begin of each member, then the indices
+  shared_ptr<Entry> open_pack(const string& index_path) {
+    auto entry = make_shared<Entry>();
+    string dir = dir_of(index_path);
+    off_t buf[3];
+    if ((entry->index_fd = open(index_path.c_str(), O_RDONLY)) < 0)
+      return nullptr;
+    if (read(entry->index_fd, buf, sizeof buf) != sizeof buf || memcmp(buf, MAGIC_GOOD, sizeof(off_t)) ||
+        buf[2] != (index_flags() | INDEX_PACK) || opt_force_rebuild)
+      return nullptr;
+    if ((entry->index_size = lseek(entry->index_fd, 0, SEEK_END)) < 0)
+      return nullptr;
+    if ((entry->index_mmap = mmap(NULL, entry->index_size, PROT_READ, MAP_SHARED, entry->index_fd, 0)) == MAP_FAILED)
+      return nullptr;
+    entry->index_path = index_path;
+    Deserializer ar((u8*)entry->index_mmap+3*sizeof(off_t));
+    SArray<off_t> sizes;
+    SArray<char> names;
+    ar & sizes & names & entry->doc_begin;
+    const char *name = names.begin();
+    REP(i, sizes.size()) {
+      entry->docs.emplace_back(new Doc);
+      auto& d = *entry->docs.back();
+      if (! d.open(to_path(dir, name)) || d.size != sizes[i])
+        return nullptr;
+      d.begin = entry->doc_begin[i];
+      name += strlen(name)+1;
+    }
+    if (entry->docs.size() < 2)
+      return nullptr;
+    read_indices(ar, *entry, buf[2]);
+    return entry;
+  }
+
+  // a compaction: entries of a directory folded into one pack
+  struct PackTask {
+    string dir;
+    vector<shared_ptr<Entry>> parts;
+  };
+
+  void* packer(void* task_) {
+    build_thread_begin();
+    auto task = (PackTask*)task_;
+    vector<unique_ptr<Doc>> docs;
+    string index_path, tmp_path;
+    shared_ptr<Entry> entry;
+    FILE* fh = NULL;
+    bool done = false;
+    StopWatch sw;
+    errno = 0;
+    for (auto& part: task->parts)
+      for (auto& d: part->docs) {
+        docs.emplace_back(new Doc);
+        if (! docs.back()->open(d->path))
+          goto quit;
+        if (docs.back()->size != d->size) { // being modified, to be reindexed
+          errno = 0;
+          goto quit;
+        }
+      }
+    sort(docs.begin(), docs.end(), [](const unique_ptr<Doc>& x, const unique_ptr<Doc>& y) { return x->path < y->path; });
+    index_path = to_path(task->dir, "."+docs[0]->path.substr(task->dir.size()+1)+pack_suffix());
+    tmp_path = index_path+".tmp";
+    if (! (fh = fopen(tmp_path.c_str(), "w")))
+      goto quit;
+    {
+      off_t total = 0, flags = index_flags() | INDEX_PACK;
+      ulong length = 0;
+      SArray<off_t> sizes;
+      string names;
+      sizes.init(docs.size());
+      REP(i, docs.size()) {
+        auto& d = *docs[i];
+        d.begin = length;
+        length += d.length;
+        total += d.size;
+        sizes[i] = d.size;
+        names += d.path.substr(task->dir.size()+1);
+        names += '\0';
+      }
+      EliasFanoBuilder eb(docs.size(), length);
+      for (auto& d: docs)
+        eb.push(d->begin);
+      EliasFano begins;
+      begins.init(eb);
+      if (fwrite(MAGIC_BAD, sizeof(off_t), 1, fh) != 1 || fwrite(&total, sizeof(off_t), 1, fh) != 1 ||
+          fwrite(&flags, sizeof(off_t), 1, fh) != 1)
+        err_exit(EX_IOERR, "fwrite");
+      Serializer ar(fh);
+      ar & sizes;
+      ar.array(ulong(names.size()), &names[0]);
+      ar & begins;
+      write_indices(ar, docs, flags);
+      if (fseeko(fh, 0, SEEK_SET) < 0)
+        err_exit(EX_IOERR, "fseeko");
+      if (fwrite(MAGIC_GOOD, sizeof(off_t), 1, fh) != 1)
+        err_exit(EX_IOERR, "fwrite");
+      if (fclose(fh) == EOF)
+        err_exit(EX_IOERR, "fclose");
+      fh = NULL;
+    }
+    if (! (entry = open_pack(tmp_path))) {
+      errno = 0;
+      goto quit;
+    }
+    entry->index_path = index_path;
+    pthread_mutex_lock(&mutex);
+    // every part has to be current, otherwise a newer index of some member has been loaded meanwhile
+    done = true;
+    for (auto& part: task->parts) {
+      auto x = loaded.find(part->docs.back()->path);
+      done = done && x && *x == part;
+    }
+    if (done && rename(tmp_path.c_str(), index_path.c_str()) < 0) {
+      err_msg("failed to rename %s", tmp_path.c_str());
+      done = false;
+    }
+    if (done) {
+      for (auto& part: task->parts) {
+        unload(part->docs.back()->path);
+        if (part->index_path != index_path)
+          unlink(part->index_path.c_str());
+      }
+      load(entry);
+      log_action("packed %zd data files of %s into %s. data: %ld, index: %ld, used %.3lf s", entry->docs.size(), task->dir.c_str(),
+                 index_path.c_str(), entry->data_size(), entry->index_size, sw.elapsed());
+    }
+    pthread_mutex_unlock(&mutex);
+    errno = 0;
+quit:
+    bool failed = errno;
+    if (failed)
+      err_msg("failed to pack %s", task->dir.c_str());
+    if (fh)
+      fclose(fh);
+    if (! done && tmp_path.size())
+      unlink(tmp_path.c_str());
+    pthread_mutex_lock(&mutex);
+    // don't retry small files that failed to be packed
+    if (failed)
+      for (auto& part: task->parts)
+        if (! part->pack())
+          small_files[task->dir].erase(part->docs[0]->path);
+    packing.erase(task->dir);
+    build_thread_end();
     pending--;
     pending_indexers--;
     pthread_cond_signal(&manager_cond);
     pthread_mutex_unlock(&mutex);
+    delete task;
     return NULL;
   }
 
+  // folds the small data files of a directory, once there are enough of them, into its smallest pack that has room
+  bool compact() {
+    bool ret = false;
+    if (! pack_file_limit || indexer_tasks.size()) return ret;
+    for (auto& x: small_files) {
+      auto& dir = x.first;
+      if (pending_indexers >= build_slots) break;
+      if (x.second.size() < pack_min_files || packing.count(dir)) continue;
+      auto task = new PackTask{dir, {}};
+      off_t size = 0;
+      shared_ptr<Entry> host;
+      for (auto& key: packs[dir]) {
+        auto& e = *loaded.find(key);
+        if (! host || e->data_size() < host->data_size())
+          host = e;
+      }
+      if (host && host->data_size() < pack_size_limit) {
+        task->parts.push_back(host);
+        size = host->data_size();
+      }
+      for (auto& key: x.second) {
+        if (size >= pack_size_limit) break;
+        task->parts.push_back(*loaded.find(key));
+        size += task->parts.back()->data_size();
+      }
+      if (task->parts.size() < 2) {
+        delete task;
+        continue;
+      }
+      packing.insert(dir);
+      pending_indexers++;
+      detached_thread(packer, task);
+      ret = true;
+    }
+    return ret;
+  }
+
   void walk(long depth, long dir_fd, string path, const char* file) {
     int fd = -1;
     struct stat statbuf;
     if (stat(path.c_str(), &statbuf) < 0)
       err_msg_g("stat");
     if (S_ISREG(statbuf.st_mode)) {
-      if (is_data(path)) add_data(path);
+      if (depth > 0 && is_pack(file)) {
+        auto entry = open_pack(path);
+        pthread_mutex_lock(&mutex);
+        if (entry) {
+          load(entry);
+          log_action("loaded pack %s of %zd data files", path.c_str(), entry->docs.size());
+        } else if (! unlink(path.c_str()))
+          log_action("unlinked stale pack %s", path.c_str());
+        pthread_mutex_unlock(&mutex);
+      } else if (is_data(path) && ! packed.count(path))
+        add_data(path);
     } else if (S_ISDIR(statbuf.st_mode)) {
       if (! opt_recursive && depth > 0) goto quit;
       if (inotify_fd >= 0)
@@ -1233,9 +2930,14 @@ success:
       if (! dirp)
         err_msg_g("opendir");
       struct dirent dirent, *dirt;
+      vector<string> names;
       while (! readdir_r(dirp, &dirent, &dirt) && dirt)
         if (strcmp(dirent.d_name, ".") && strcmp(dirent.d_name, ".."))
-          walk(depth+1, fd, to_path(path, dirent.d_name), dirent.d_name);
+          names.push_back(dirent.d_name);
+      // packs first, their members are not indexed alone
+      stable_partition(names.begin(), names.end(), is_pack);
+      for (auto& name: names)
+        walk(depth+1, fd, to_path(path, name), name.c_str());
       closedir(dirp);
       fd = -1;
     }
@@ -1270,7 +2972,9 @@ quit:;
             if (lstat(path.c_str(), &statbuf) < 0) continue;
             if (ev->mask & IN_MOVED_TO || S_ISLNK(statbuf.st_mode)) {
               modified.erase(path);
+              pthread_mutex_lock(&mutex);
               add_data(path);
+              pthread_mutex_unlock(&mutex);
             } else
               modified.insert(path);
           }
@@ -1297,46 +3001,310 @@ quit:;
           if (modified.count(path)) {
             log_event("CLOSE_WRITE after MODIFY %s", path.c_str());
             modified.erase(path);
-            if (data) add_data(path);
+            if (data) {
+              pthread_mutex_lock(&mutex);
+              add_data(path);
+              pthread_mutex_unlock(&mutex);
+            }
           }
         }
       }
   }
 
-  void* request_worker(void* connfd_) {
-    int connfd = intptr_t(connfd_);
-    char buf[BUF_SIZE] = {};
-    const char *p, *file_begin = buf, *file_end = nullptr;
-    int nread = 0;
-    timespec timeout;
+  // the class selected by the first field of a request
+  long request_class(const string& request) {
+    const char *p = request.c_str();
+    long lane = LANE_SEARCH;
+    if (! *p || ! strcmp(p, "x") || ! strcmp(p, "stats"))
+      lane = LANE_AUTOCOMPLETE;
+    else
+      for (; *p && *p != ' '; p++)
+        if (*p == 'b')
+          lane = LANE_BATCH;
+        else if (*p == 'g' && lane != LANE_BATCH)
+          lane = LANE_COUNT;
+        else if (*p == 'a' && lane == LANE_SEARCH)
+          lane = LANE_EXPORT;
+    return lane;
+  }
+
+  // `name \t value` lines describing the server: catalog, builds and their throttle, request pool
+  void print_stats(BufferedWriter& out) {
+    long indices;
     {
-      double tmp;
-      timeout.tv_sec = modf(request_timeout, &tmp);
-      timeout.tv_nsec = tmp;
+      EpochGuard guard;
+      indices = loaded.snapshot().size();
     }
+    pthread_mutex_lock(&mutex);
+    long running = pending_indexers, queued = indexer_tasks.size(), slots = build_slots, idle = idle_tids.size();
+    pthread_mutex_unlock(&mutex);
+    out.printf("indices\t%ld\n", indices);
+    out.printf("builds_running\t%ld\nbuilds_queued\t%ld\n", running, queued);
+    out.printf("build_slots\t%ld\nindexer_limit\t%ld\nbuilds_idle\t%ld\n", slots, indexer_limit, idle);
+    out.printf("throttle_p99\t%lg\nquery_p99\t%lg\n", throttle_p99, latencies.p99.load());
+    out.printf("expired\t%ld\nshed\t%ld\n", pool.expired.load(), pool.shed.load());
+    if (backends.size())
+      out.printf("backends\t%zu\nbackend_failures\t%ld\n", backends.size(), backend_failures.load());
+  }
 
-    struct pollfd fds;
-    fds.fd = connfd;
-    fds.events = POLLIN;
+  ///// coordinator
 
+  // sends `req` to `backend`, half-closes and reads the response until EOF; false on failure, past `deadline` or once our client hangs up
+  bool ask_backend(const string& backend, const string& req, double deadline, CancelToken& cancel, string& res) {
+    int fd = dial(backend);
+    size_t sent = 0;
+    bool ok = false;
+    res.clear();
+    if (fd < 0) goto quit;
     for(;;) {
-      int ready = ppoll(&fds, 1, &timeout, NULL);
-      if (ready < 0) {
-        if (errno == EINTR) continue;
-        goto quit;
+      double left = deadline-monotonic_time();
+      if (left <= 0 || cancel.check()) goto quit;
+      struct pollfd p = {fd, short(sent < req.size() ? POLLOUT : POLLIN), 0};
+      int ready = poll(&p, 1, long(min(left, 0.05)*1000)+1); // wake up to check for a hang-up
+      if (ready < 0 && errno != EINTR) goto quit;
+      if (ready <= 0) continue;
+      ssize_t n;
+      if (sent < req.size()) {
+        if ((n = send(fd, req.data()+sent, req.size()-sent, MSG_NOSIGNAL)) < 0) {
+          if (errno == EAGAIN || errno == EINTR) continue;
+          goto quit;
+        }
+        if ((sent += n) == req.size() && shutdown(fd, SHUT_WR) < 0)
+          goto quit;
+      } else {
+        char buf[BUF_SIZE];
+        if ((n = read(fd, buf, sizeof buf)) < 0) {
+          if (errno == EAGAIN || errno == EINTR) continue;
+          goto quit;
+        }
+        if (! n) break;
+        res.append(buf, n);
       }
-      if (! ready) goto quit; // timeout
-      ssize_t t = read(connfd, buf+nread, sizeof buf-nread);
-      if (t < 0) goto quit;
-      if (! t) break;
-      nread += t;
+    }
+    // an empty response: the backend shed or rejected the request
+    ok = res.size();
+    close(fd);
+    fd = -1;
+quit:
+    // giving up on the backend: a reset lets it cancel the request, even over TCP
+    if (fd >= 0)
+      close_reset(fd);
+    if (! ok && ! cancel.cancelled) {
+      backend_failures++;
+      log_status("no response from backend %s", backend.c_str());
+    }
+    return ok;
+  }
+
+  // lines of a text response; the last one of a search is the total, `N`, `N+` (a lower bound) or `N~` (an estimate)
+  vector<string> response_lines(const string& res) {
+    auto lines = split_lines(res.size(), res.data());
+    if (lines.size() && lines.back().empty())
+      lines.pop_back();
+    return lines;
+  }
+
+  // forwards a request to every backend, each owning a shard of the directories, and merges the responses as if the shards were
+  // listed in the order of the backends. A search first collects the totals of the shards, then asks each shard only for its part of
+  // the requested page. A shard that fails or times out is left out and the total becomes a lower bound. Batch and binary responses
+  // are not merged: they are relayed from a single backend, and answered with an error otherwise
+  void coordinate(string& request, BufferedWriter& out, CancelToken& cancel, double deadline) {
+    size_t nul = request.find('\0'), n = backends.size();
+    if (nul == string::npos) return;
+    string first = request.substr(0, nul), rest = request.substr(nul);
+    size_t space = first.find(' ');
+    string filters = space == string::npos ? "" : first.substr(space);
+    first.resize(min(space, first.size()));
+    // each backend gets backend_timeout seconds per exchange, cut short by the deadline of the request
+    auto ask_all = [&](const vector<string>& reqs, vector<string>& res) {
+      vector<char> ok(n);
+      res.assign(n, "");
+      parallel_for(n, n, [&](long i) {
+        double until = monotonic_time()+backend_timeout;
+        if (reqs[i].size())
+          ok[i] = ask_backend(backends[i], reqs[i], deadline > 0 ? min(until, deadline) : until, cancel, res[i]);
+      });
+      return ok;
+    };
+    vector<string> res;
+
+    bool binary = first.find('x') != string::npos;
+    if (binary || first.find('b') != string::npos) {
+      string body;
+      double until = monotonic_time()+backend_timeout;
+      const char *error = n > 1 ? "batch and binary requests need a single backend" : nullptr;
+      if (! error && ! ask_backend(backends[0], request, deadline > 0 ? min(until, deadline) : until, cancel, body))
+        error = "no response from the backend";
+      if (! error) {
+        out.buf += body;
+        out.maybe_flush();
+      } else if (binary)
+        BinaryResponse(out).byte(BinaryResponse::ERROR).bytes(error).end();
+      else
+        out.printf("error\t%s\n", error);
+      return;
+    }
+
+    // autocomplete: counts of a suggestion add up, the line of the backend counting it most represents it
+    if (first.empty()) {
+      auto ok = ask_all(vector<string>(n, request), res);
+      // suggestion -> total count, that line before and after its count, count in that backend
+      map<string, tuple<ulong, string, string, ulong>> cands;
+      REP(i, n)
+        if (ok[i])
+          for (auto& line: response_lines(res[i])) {
+            size_t t1 = line.find('\t'), t2 = line.find('\t', t1+1), t3 = line.find('\t', t2+1);
+            if (t3 == string::npos) continue;
+            size_t t4 = min(line.find('\t', t3+1), line.size());
+            ulong count = strtoul(line.c_str()+t3+1, NULL, 10);
+            auto& cand = cands[line.substr(t2+1, t3-t2-1)];
+            get<0>(cand) += count;
+            if (get<3>(cand) < count || get<1>(cand).empty()) {
+              get<1>(cand) = line.substr(0, t3+1);
+              get<2>(cand) = line.substr(t4);
+              get<3>(cand) = count;
+            }
+          }
+      typedef pair<string, tuple<ulong, string, string, ulong>> cand_type;
+      vector<cand_type> sorted(cands.begin(), cands.end());
+      sort(sorted.begin(), sorted.end(), [](const cand_type& x, const cand_type& y) {
+        return get<0>(x.second) != get<0>(y.second) ? get<0>(x.second) > get<0>(y.second) : x.first < y.first;
+      });
+      if (sorted.size() > autocomplete_limit)
+        sorted.resize(autocomplete_limit);
+      for (auto& cand: sorted)
+        if (! out.printf("%s%lu%s\n", get<1>(cand.second).c_str(), get<0>(cand.second), get<2>(cand.second).c_str()))
+          return;
+      return;
     }
 
+    char *end;
+    errno = 0;
+    ulong skip = strtoul(first.c_str(), &end, 10);
+    string mods = end;
+    if (errno) return;
+    bool partial = false, estimate = false;
+    ulong limit = search_limit;
+    for (const char *m = mods.c_str(); *m; m++)
+      if (*m == 'a')
+        limit = ULONG_MAX;
+      else if (*m == 'n')
+        limit = strtoul(m+1, NULL, 10);
+    auto total_of = [&](const string& line) {
+      if (line.size() && line.back() == '+') partial = true;
+      if (line.size() && line.back() == '~') estimate = true;
+      return strtod(line.c_str(), NULL);
+    };
+
+    // aggregation: the histograms of the shards add up, then skip and limit apply to each group as usual
+    if (mods.find('g') != string::npos) {
+      auto ok = ask_all(vector<string>(n, "0"+mods+"a"+filters+rest), res);
+      double total = 0;
+      map<string, map<long, double>> groups;
+      REP(i, n) {
+        auto lines = response_lines(res[i]);
+        if (! ok[i] || lines.empty()) {
+          partial = true;
+          continue;
+        }
+        total += total_of(lines.back());
+        lines.pop_back();
+        for (auto& line: lines) {
+          size_t t1 = line.find('\t'), t2 = line.find('\t', t1+1);
+          if (t2 == string::npos) continue;
+          string group = line.substr(0, t1), key = line.substr(t1+1, t2-t1-1);
+          in_addr addr;
+          long k = group == "cip" ? inet_pton(AF_INET, key.c_str(), &addr) == 1 ? long(ntohl(addr.s_addr)) : -1 : strtol(key.c_str(), NULL, 10);
+          groups[group][k] += strtod(line.c_str()+t2+1, NULL);
+        }
+      }
+      for (const char *group: {"sport", "cip", "minute"}) {
+        auto& hist = groups[group];
+        vector<pair<long, double>> sorted(hist.begin(), hist.end());
+        sort(sorted.begin(), sorted.end(), [](const pair<long, double>& x, const pair<long, double>& y) {
+          return x.second != y.second ? x.second > y.second : x.first < y.first;
+        });
+        for (ulong i = skip; i < sorted.size() && i-skip < limit; i++) {
+          char key[INET_ADDRSTRLEN];
+          in_addr addr{htonl(u32(sorted[i].first))};
+          if (group[0] == 'c')
+            inet_ntop(AF_INET, &addr, key, sizeof key);
+          else
+            snprintf(key, sizeof key, "%ld", sorted[i].first);
+          if (! out.printf("%s\t%s\t%.0f\n", group, key, sorted[i].second))
+            return;
+        }
+      }
+      out.printf(partial ? "%.0f+\n" : estimate ? "%.0f~\n" : "%.0f\n", total);
+      return;
+    }
+
+    // searches: totals first, with a skip past every hit
+    auto ok = ask_all(vector<string>(n, "1000000000000000000"+mods+filters+rest), res);
+    vector<ulong> totals(n), from(n), need(n);
+    REP(i, n) {
+      auto lines = response_lines(res[i]);
+      if (ok[i] && lines.size())
+        totals[i] = total_of(lines.back());
+      else {
+        ok[i] = false;
+        partial = true;
+      }
+    }
+    // the part of the page each shard holds
+    ulong skip0 = skip, want = limit, total = 0;
+    REP(i, n) {
+      total += totals[i];
+      if (skip0 >= totals[i]) {
+        skip0 -= totals[i];
+        continue;
+      }
+      from[i] = skip0;
+      need[i] = min(want, totals[i]-skip0);
+      want -= need[i];
+      skip0 = 0;
+    }
+    // `n` asks for exactly the rows of the page, whether or not they are listed
+    vector<string> reqs(n);
+    REP(i, n)
+      if (need[i])
+        reqs[i] = to_string(from[i])+mods+"n"+to_string(need[i])+filters+rest;
+    ok = ask_all(reqs, res);
+    REP(i, n) {
+      if (! need[i]) continue;
+      auto lines = response_lines(res[i]);
+      if (! ok[i] || lines.empty()) {
+        partial = true;
+        continue;
+      }
+      lines.pop_back();
+      for (auto& line: lines)
+        if (! out.printf("%s\n", line.c_str()))
+          return;
+    }
+    out.printf(partial ? "%lu+\n" : "%lu\n", total);
+  }
+
+  // answers `request` into `out`, stopping once a write to the client fails or `cancel` is set, or returning partial results past
+  // `deadline`
+  void answer_request(string& request, BufferedWriter& out, CancelToken& cancel, double deadline) {
+    char *buf = &request[0];
+    if (! strcmp(buf, "stats")) {
+      print_stats(out);
+      return;
+    }
+    if (backends.size()) {
+      coordinate(request, out, cancel, deadline);
+      return;
+    }
+    const char *p, *file_begin = nullptr, *file_end = nullptr;
+    long nread = request.size();
+
     for (p = buf; p < buf+nread && *p; p++);
-    if (++p >= buf+nread) goto quit;
+    if (++p >= buf+nread) return;
     file_begin = p;
     for (; p < buf+nread && *p; p++);
-    if (++p >= buf+nread) goto quit;
+    if (++p >= buf+nread) return;
     file_end = p;
     for (; p < buf+nread && *p; p++);
     ulong len;
@@ -1347,80 +3315,420 @@ quit:;
       len = 0;
 
     {
-      pthread_mutex_lock(&mutex);
-      auto* root = loaded.root;
-      if (root) root->refcnt++;
-      pthread_mutex_unlock(&mutex);
+      // `x` in place of the skip requests a binary autocomplete response
+      bool opt_binary = ! strcmp(buf, "x");
+      BinaryResponse bin(out);
 
       vector<ulong> res;
       ulong total = 0;
       string pattern = unescape(len, p), low, high("\xff"); // assume low <= filepath <= high
-      auto range = loaded.range_backward(root, low, high, *file_begin ? string(file_begin) : low, *file_end ? string(file_end) : high);
+      string fb = *file_begin ? string(file_begin) : low, fe = *file_end ? string(file_end) : high;
+      // by decreasing path, as listed from the catalog
+      vector<shared_ptr<Entry>> entries;
+      {
+        EpochGuard guard;
+        loaded.snapshot().overlapping(fb, fe, [&](const shared_ptr<Entry>& entry) { entries.push_back(entry); });
+      }
+      reverse(entries.begin(), entries.end());
       // autocomplete
-      if (! buf[0]) {
-        typedef tuple<string, ulong, string> cand_type;
-        ulong skip = 0;
-        vector<cand_type> candidates;
-        for (auto& it: range) {
-          auto entry = it.val;
-          auto old_size = res.size();
-          entry->fm->locate(pattern.size(), (const u8*)pattern.c_str(), true, autocomplete_limit, skip, res);
-          FOR(i, old_size, res.size())
-            candidates.emplace_back(it.key, res[i], string((char*)entry->data_mmap+res[i], (char*)entry->data_mmap+min(ulong(entry->data_size), res[i]+len+autocomplete_length)));
-          if (res.size() >= autocomplete_limit) break;
+      if (! buf[0] || opt_binary) {
+        // suggestion -> total count, filename & offset of a representative occurrence, count in that file, its entry
+        typedef tuple<ulong, string, ulong, ulong, Entry*> cand_type;
+        map<string, cand_type> candidates;
+        string rpattern(pattern.rbegin(), pattern.rend());
+        Budget clock(LONG_MAX, 0, deadline, &cancel);
+        for (auto& entry: entries) {
+          if (! clock.alive(1)) break;
+          // each index gets the whole budget, so that the ranking does not depend on the order of the indices; the deadline
+          // bounds the total
+          ulong budget = autocomplete_budget;
+          vector<pair<ulong, string>> conts;
+          if (entry->rfm)
+            entry->rfm->continuations(rpattern.size(), (const u8*)rpattern.c_str(), autocomplete_limit, autocomplete_length, budget, conts);
+          else {
+            // no index of reversed text, sample the interval
+            ulong skip = 0;
+            res.clear();
+            entry->fm->locate(pattern.size(), (const u8*)pattern.c_str(), true, autocomplete_limit, skip, res);
+            for (auto x: res) {
+              long pos = entry->data_pos(x, pattern.size());
+              if (pos >= 0)
+                conts.emplace_back(1, entry->bytes(pos+pattern.size(), entry->pmap ? entry->pmap->clip(x, pattern.size()+autocomplete_length)-pattern.size() : autocomplete_length));
+            }
+          }
+          for (auto& cont: conts) {
+            string sug = pattern+cont.second;
+            ulong l, h;
+            tie(l, h) = entry->fm->get_range(sug.size(), (const u8*)sug.c_str());
+            if (l >= h) continue;
+            // in a payload-only index, cut the suggestion at the end of the payload of its first occurrence
+            ulong tpos = entry->fm->calc_sa(l);
+            if (entry->pmap)
+              sug.resize(entry->pmap->clip(tpos, sug.size()));
+            long pos = entry->data_pos(tpos, sug.size());
+            if (sug.size() < pattern.size() || pos < 0) continue;
+            auto& path = entry->doc_of(pos).path;
+            if (path < fb || fe < path) continue;
+            auto& cand = candidates[sug];
+            get<0>(cand) += cont.first;
+            if (get<3>(cand) < cont.first) {
+              get<1>(cand) = path;
+              get<2>(cand) = pos;
+              get<3>(cand) = cont.first;
+              get<4>(cand) = entry.get();
+            }
+          }
+        }
+        vector<pair<string, cand_type>> sorted(candidates.begin(), candidates.end());
+        sort(sorted.begin(), sorted.end(), [](const pair<string, cand_type>& x, const pair<string, cand_type>& y) {
+          return get<0>(x.second) != get<0>(y.second) ? get<0>(x.second) > get<0>(y.second) : x.first < y.first;
+        });
+        if (sorted.size() > autocomplete_limit)
+          sorted.resize(autocomplete_limit);
+        for (auto& cand: sorted) {
+          if (! get<3>(cand.second)) continue;
+          auto& entry = *get<4>(cand.second);
+          ulong pos = get<2>(cand.second), offset = pos-entry.doc_of(pos).begin;
+          string meta = hit_metadata(entry, pos, cand.first.size(), opt_binary);
+          if (! (opt_binary
+                 ? bin.byte(bin.SUGGESTION).file(get<1>(cand.second)).varint(offset).varint(get<0>(cand.second)).bytes(cand.first).raw(meta).end()
+                 : out.printf("%s\t%lu\t%s\t%lu%s\n", get<1>(cand.second).c_str(), offset, escape(cand.first).c_str(), get<0>(cand.second), meta.c_str())))
+            return;
         }
-        sort(candidates.begin(), candidates.end(), [](const cand_type& x, const cand_type& y) { return get<2>(x) < get<2>(y); });
-        candidates.erase(unique(candidates.begin(), candidates.end(), [](const cand_type &x, const cand_type &y) { return get<2>(x) == get<2>(y); }), candidates.end());
-        for (auto& cand: candidates)
-          if (dprintf(connfd, "%s\t%lu\t%s\n", get<0>(cand).c_str(), get<1>(cand), escape(get<2>(cand)).c_str()) < 0)
-            goto quit;
       } else {
+        // skip, followed by modifiers
         char *end;
         errno = 0;
-        ulong skip = strtoul(buf, &end, 0);
-        if (! *end && ! errno) {
-          for (auto& it: range) {
-            auto entry = it.val;
-            auto old_size = res.size();
-            total += entry->fm->locate(pattern.size(), (const u8*)pattern.c_str(), false, search_limit, skip, res);
-            FOR(i, old_size, res.size())
-              if (dprintf(connfd, "%s\t%lu\t%lu\n", it.key.c_str(), res[i], len) < 0)
-                goto quit;
-            if (res.size() >= search_limit) break;
+        ulong skip = strtoul(buf, &end, 10);
+        bool opt_regex = false, opt_edit = false, opt_icase = false, opt_wide = false, opt_batch = false, opt_flow = false, opt_context = false, opt_aggregate = false;
+        long opt_distance = -1;
+        ulong limit = search_limit;
+        FlowFilter filter;
+        filter.file_begin = fb;
+        filter.file_end = fe;
+        while (*end && ! errno)
+          switch (*end++) {
+          case ' ':
+            // the rest are filters
+            if (! filter.parse(end))
+              errno = EINVAL;
+            end += strlen(end);
+            break;
+          case 'r': opt_regex = true; break;
+          case 'i': opt_icase = true; break;
+          case 'w': opt_wide = true; break;
+          case 'b': opt_batch = true; break;
+          case 'f': opt_flow = true; break;
+          case 'c': opt_context = true; break;
+          case 'g': opt_aggregate = true; break;
+          case 'a': limit = LONG_MAX; break;
+          case 'n': limit = strtoul(end, &end, 10); break;
+          case 'x': opt_binary = true; break;
+          case 'e': case 'h':
+            opt_edit = end[-1] == 'e';
+            opt_distance = strtol(end, &end, 10);
+            if (opt_distance > approx_max_distance)
+              errno = EINVAL;
+            break;
+          default: errno = EINVAL; break;
+          }
+        // the pattern itself, and its UTF-16LE form with `w`
+        vector<string> variants{pattern};
+        vector<Regex> regexes(opt_wide ? 2 : 1);
+        if (opt_wide)
+          variants.push_back(widen(pattern));
+        if (opt_regex && opt_distance >= 0 || (opt_batch || opt_flow) && (opt_regex || opt_distance >= 0) || opt_batch && opt_flow ||
+            opt_aggregate && (opt_batch || opt_flow || opt_distance >= 0))
+          errno = EINVAL;
+        if (opt_regex && ! opt_batch)
+          REP(i, regexes.size())
+            if (! regexes[i].compile(string(p, len), opt_icase, i))
+              errno = EINVAL;
+        if (! errno && opt_batch) {
+          // one \-escaped pattern per line; pattern i is reported as i
+          vector<string> patterns;
+          for (auto& line: split_lines(len, p))
+            patterns.push_back(unescape(line.size(), line.data()));
+          PatternTrie trie;
+          REP(i, patterns.size())
+            if (patterns[i].size()) {
+              trie.insert(patterns[i], i);
+              if (opt_wide)
+                trie.insert(widen(patterns[i]), i);
+            }
+          auto& files = entries;
+
+          // per file and pattern: number of occurrences and the first skip+limit hits
+          vector<vector<ulong>> totals(files.size());
+          vector<vector<vector<Hit>>> hits(files.size());
+          vector<char> exhausted(files.size());
+          parallel_for(files.size(), batch_threads, [&](long i) {
+            auto& entry = *files[i];
+            Budget budget(search_budget, 0, deadline, &cancel);
+            vector<vector<Match>> matches(patterns.size());
+            totals[i].resize(patterns.size());
+            hits[i].resize(patterns.size());
+            if (! budget.alive(1)) {
+              exhausted[i] = true;
+              return;
+            }
+            if (filter.active && ! entry.flows.may_match(filter)) return;
+            trie.search(*entry.fm, opt_icase, budget, matches);
+            REP(j, patterns.size()) {
+              ulong skip0 = 0;
+              totals[i][j] = restricted(entry, filter)
+                ? locate_filtered(entry, filter, matches[j], skip+limit, skip0, budget, hits[i][j])
+                : entry.fm->locate(matches[j], skip+limit, skip0, hits[i][j], entry.pmap, &budget);
+            }
+            exhausted[i] = budget.exhausted();
+          });
+
+          bool any_exhausted = count(exhausted.begin(), exhausted.end(), 1) > 0;
+          REP(j, patterns.size()) {
+            ulong skip0 = skip, n = 0;
+            total = 0;
+            REP(i, files.size()) {
+              auto& hs = hits[i][j];
+              ulong delta = min(hs.size(), skip0);
+              total += totals[i][j];
+              skip0 -= delta;
+              for (ulong k = delta; k < hs.size() && n < limit; k++, n++) {
+                if (hs[k].pos == Hit::SPANNING) continue;
+                auto& d = files[i]->doc_of(hs[k].pos);
+                string meta = opt_context ? hit_metadata(*files[i], hs[k].pos, hs[k].len, opt_binary) : "";
+                if (! (opt_binary
+                       ? bin.byte(bin.HIT).varint(j).file(d.path).varint(hs[k].pos-d.begin).varint(hs[k].len).raw(meta).end()
+                       : out.printf("%lu\t%s\t%lu\t%lu%s\n", j, d.path.c_str(), hs[k].pos-d.begin, hs[k].len, meta.c_str())))
+                  return;
+              }
+            }
+            if (! (opt_binary
+                   ? bin.byte(bin.TOTAL).varint(j).varint(total).byte(any_exhausted ? bin.LOWER_BOUND : 0).end()
+                   : out.printf(any_exhausted ? "%lu\t%lu+\n" : "%lu\t%lu\n", j, total)))
+              return;
+          }
+        } else if (! errno && opt_aggregate) {
+          vector<shared_ptr<Entry>> files;
+          for (auto& entry: entries)
+            if (! filter.active || entry->flows.may_match(filter))
+              files.push_back(entry);
+
+          // find the intervals, then locate a uniform sample of at most aggregate_sample rows over all files
+          vector<vector<Match>> matches(files.size());
+          vector<Histograms> hists(files.size());
+          vector<char> exhausted(files.size());
+          parallel_for(files.size(), batch_threads, [&](long i) {
+            Budget budget(search_budget, 0, deadline, &cancel);
+            if (! budget.alive(1)) {
+              exhausted[i] = true;
+              return;
+            }
+            if (opt_regex)
+              for (auto& re: regexes)
+                re.search(*files[i]->fm, budget, matches[i]);
+            else
+              matches[i] = pattern_ranges(*files[i]->fm, pattern, opt_icase, opt_wide);
+            exhausted[i] = budget.exhausted();
+          });
+          ulong rows = 0;
+          for (auto& ms: matches)
+            for (auto& m: ms)
+              rows += m.h-m.l;
+          double rate = rows > aggregate_sample ? double(aggregate_sample)/rows : 1;
+          parallel_for(files.size(), batch_threads, [&](long i) {
+            Budget budget(search_budget, 0, deadline, &cancel);
+            aggregate_hits(*files[i], filter, matches[i], rate, budget, hists[i]);
+            exhausted[i] |= budget.exhausted();
+          });
+          FOR(i, 1, hists.size())
+            hists[0].merge(hists[i]);
+
+          // `group \t key \t count` by decreasing count; skip and limit apply to each group
+          Histograms h = hists.empty() ? Histograms() : hists[0];
+          auto print = [&](const char* group, const map<long, double>& hist) {
+            int group_id = group[0] == 's' ? 0 : group[0] == 'c' ? 1 : 2;
+            vector<pair<long, double>> sorted(hist.begin(), hist.end());
+            sort(sorted.begin(), sorted.end(), [](const pair<long, double>& x, const pair<long, double>& y) {
+              return x.second != y.second ? x.second > y.second : x.first < y.first;
+            });
+            for (ulong i = skip; i < sorted.size() && i-skip < limit; i++) {
+              if (opt_binary) {
+                if (! bin.byte(bin.GROUP).byte(group_id).varint(sorted[i].first).varint(llround(sorted[i].second)).end())
+                  return false;
+                continue;
+              }
+              char key[INET_ADDRSTRLEN];
+              in_addr addr{htonl(u32(sorted[i].first))};
+              if (group[0] == 'c')
+                inet_ntop(AF_INET, &addr, key, sizeof key);
+              else
+                snprintf(key, sizeof key, "%ld", sorted[i].first);
+              if (! out.printf("%s\t%s\t%.0f\n", group, key, sorted[i].second))
+                return false;
+            }
+            return true;
+          };
+          if (! print("sport", h.server_ports) || ! print("cip", h.client_ips) || ! print("minute", h.minutes))
+            return;
+          // a lower bound if the budget is exhausted, an estimate if sampled
+          bool any_exhausted = count(exhausted.begin(), exhausted.end(), 1) > 0;
+          if (opt_binary)
+            bin.byte(bin.TOTAL).varint(llround(h.hits)).byte(any_exhausted ? bin.LOWER_BOUND : rate < 1 ? bin.ESTIMATE : 0);
+          else
+            out.printf(any_exhausted ? "%.0f+\n" : rate < 1 ? "%.0f~\n" : "%.0f\n", h.hits);
+        } else if (! errno && opt_flow) {
+          // one \-escaped term per line, negated if prefixed with !
+          vector<FlowTerm> terms;
+          for (auto& line: split_lines(len, p))
+            if (line.size() && line != "!") {
+              bool negated = line[0] == '!';
+              terms.push_back(FlowTerm{unescape(line.size()-negated, line.data()+negated), negated});
+            }
+          Budget budget(search_budget, 0, deadline, &cancel);
+          ulong n = 0;
+          for (auto& entry: entries) {
+            if (! budget.alive(1)) break;
+            vector<pair<long, Hit>> flows;
+            if (filter.active && ! entry->flows.may_match(filter)) continue;
+            flow_query(*entry, terms, opt_icase, opt_wide, filter, budget, flows);
+            ulong delta = min(flows.size(), skip);
+            total += flows.size();
+            skip -= delta;
+            for (ulong i = delta; i < flows.size() && n < limit; i++, n++) {
+              auto& hit = flows[i].second;
+              auto& d = entry->doc_of(hit.pos);
+              string meta = opt_context ? hit_metadata(*entry, hit.pos, hit.len, opt_binary) : "";
+              if (! (opt_binary
+                     ? bin.byte(bin.HIT).file(d.path).varint(hit.pos-d.begin).varint(hit.len).varint(u32(flows[i].first)).raw(meta).end()
+                     : out.printf("%s\t%lu\t%lu\t%ld%s\n", d.path.c_str(), hit.pos-d.begin, hit.len, long(u32(flows[i].first)), meta.c_str())))
+                return;
+            }
+            if (budget.exhausted()) break;
+          }
+          if (opt_binary)
+            bin.byte(bin.TOTAL).varint(total).byte(budget.exhausted() ? bin.LOWER_BOUND : 0);
+          else
+            out.printf(budget.exhausted() ? "%lu+\n" : "%lu\n", total);
+        } else if (! errno) {
+          vector<Hit> hits;
+          Budget budget(search_budget, opt_distance >= 0 ? approx_cpu_limit : 0, deadline, &cancel);
+          for (auto& entry: entries) {
+            if (! budget.alive(1)) break;
+            auto old_size = hits.size();
+            if (filter.active && ! entry->flows.may_match(filter)) continue;
+            if (opt_distance >= 0) {
+              vector<Hit> approx;
+              for (auto& v: variants)
+                approx_hits(*entry->fm, entry->rfm, entry->pmap, v, opt_edit, opt_icase, opt_distance, budget, approx);
+              if (restricted(*entry, filter))
+                approx.erase(remove_if(approx.begin(), approx.end(), [&](const Hit &x) {
+                  return ! hit_matches(*entry, filter, x.pos, x.len);
+                }), approx.end());
+              ulong delta = min(approx.size(), skip);
+              total += approx.size();
+              skip -= delta;
+              for (ulong i = delta; i < approx.size() && hits.size() < limit; i++)
+                hits.push_back(approx[i]);
+            } else {
+              vector<Match> matches;
+              if (opt_regex)
+                for (auto& re: regexes)
+                  re.search(*entry->fm, budget, matches);
+              else
+                matches = pattern_ranges(*entry->fm, pattern, opt_icase, opt_wide);
+              total += restricted(*entry, filter)
+                ? locate_filtered(*entry, filter, matches, limit, skip, budget, hits)
+                : entry->fm->locate(matches, limit, skip, hits, entry->pmap, &budget);
+            }
+            FOR(i, old_size, hits.size()) {
+              if (hits[i].pos == Hit::SPANNING) continue;
+              string meta = opt_context ? hit_metadata(*entry, hits[i].pos, hits[i].len, opt_binary) : "";
+              auto& d = entry->doc_of(hits[i].pos);
+              if (opt_binary) {
+                bin.byte(bin.HIT).file(d.path).varint(hits[i].pos-d.begin).varint(hits[i].len);
+                if (opt_distance >= 0)
+                  bin.varint(hits[i].dist);
+                if (! bin.raw(meta).end())
+                  return;
+              } else if (! (opt_distance >= 0
+                            ? out.printf("%s\t%lu\t%lu\t%lu%s\n", d.path.c_str(), hits[i].pos-d.begin, hits[i].len, hits[i].dist, meta.c_str())
+                            : out.printf("%s\t%lu\t%lu%s\n", d.path.c_str(), hits[i].pos-d.begin, hits[i].len, meta.c_str())))
+                return;
+            }
+            if (hits.size() >= limit || budget.exhausted()) break;
           }
-          dprintf(connfd, "%lu\n", total);
+          // a lower bound if the budget is exhausted
+          if (opt_binary)
+            bin.byte(bin.TOTAL).varint(total).byte(budget.exhausted() ? bin.LOWER_BOUND : 0);
+          else
+            out.printf(budget.exhausted() ? "%lu+\n" : "%lu\n", total);
         }
       }
+    }
+  }
 
-      pthread_mutex_lock(&mutex);
-      if (root) root->unref();
-      pthread_mutex_unlock(&mutex);
+  // answers a request within the deadline of its class, counted from the time it was `queued` as the client waits from then on;
+  // times autocomplete and search requests for the build throttle
+  void process_request(string& request, BufferedWriter& out, CancelToken& cancel, double queued) {
+    long cls = request_class(request);
+    answer_request(request, out, cancel, lane_deadline[cls] > 0 ? queued+lane_deadline[cls] : 0);
+    if (cls == LANE_AUTOCOMPLETE || cls == LANE_SEARCH)
+      latencies.add(monotonic_time()-queued);
+  }
+
+  // reads a request in lane 0, then queues it in the lane of its class, where a shed request is dropped unanswered;
+  // the request keeps the time its connection was queued in lane 0
+  void request_worker(int connfd, double queued) {
+    auto request = make_shared<string>();
+    if (! read_request(connfd, request_timeout, request_size_limit, *request)) {
+      close(connfd);
+      return;
     }
-quit:
-    close(connfd);
-    pthread_mutex_lock(&mutex);
-    if (! --pending)
-      pthread_cond_signal(&pending_empty);
-    pthread_mutex_unlock(&mutex);
-    return NULL;
+    pool.push([connfd, request, queued](bool late, double) {
+      if (! late) {
+        BufferedWriter out(connfd);
+        CancelToken cancel(connfd);
+        process_request(*request, out, cancel, queued);
+        if (cancel.cancelled)
+          log_event("cancelled a request whose client hung up");
+      }
+      close(connfd);
+    }, lane_ids[request_class(*request)]);
   }
 
   void* manager(void*) {
     for(;;) {
       pthread_mutex_lock(&mutex);
-      while (! manager_quit && loaded.roots.empty() && (indexer_tasks.empty() || pending_indexers >= indexer_limit))
-        pthread_cond_wait(&manager_cond, &mutex);
-      while (indexer_tasks.size() && pending_indexers < indexer_limit) {
+      throttle();
+      while (! manager_quit && ! loaded.dirty() && (indexer_tasks.empty() || pending_indexers >= build_slots) && ! compact()) {
+        if (throttle_p99 <= 0)
+          pthread_cond_wait(&manager_cond, &mutex);
+        else {
+          timespec ts;
+          clock_gettime(CLOCK_REALTIME, &ts);
+          ts.tv_sec++;
+          pthread_cond_timedwait(&manager_cond, &mutex, &ts);
+          throttle();
+        }
+      }
+      while (indexer_tasks.size() && pending_indexers < build_slots) {
         pending_indexers++;
         detached_thread(indexer, new string(indexer_tasks.back()));
         indexer_tasks.pop_back();
       }
-      while (loaded.roots.size()) {
-        if (loaded.roots.back())
-          loaded.roots.back()->unref();
-        loaded.roots.pop_back();
-      }
+      if (! manager_quit)
+        compact();
+      // one snapshot for all the changes since the last round, the replaced one is freed once no query can be reading it
+      if (loaded.dirty())
+        loaded.publish();
+      vector<decltype(loaded)::Snapshot*> retired;
+      retired.swap(loaded.retired);
       pthread_mutex_unlock(&mutex);
+      if (retired.size()) {
+        Epoch::synchronize();
+        for (auto x: retired)
+          delete x;
+      }
       if (manager_quit) break;
     }
     pthread_mutex_lock(&mutex);
@@ -1432,6 +3740,7 @@ quit:
 
   void run() {
     signal(SIGPIPE, SIG_IGN); // SIGPIPE while writing to clients
+    build_slots = indexer_limit;
 
     int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
     if (sockfd < 0)
@@ -1443,7 +3752,7 @@ quit:
       log_action("removed old socket %s", listen_path);
     if (bind(sockfd, (struct sockaddr *)&addr, sizeof addr) < 0)
       err_exit(EX_OSERR, "bind");
-    if (listen(sockfd, 1) < 0)
+    if (listen(sockfd, SOMAXCONN) < 0)
       err_exit(EX_OSERR, "listen");
     log_status("listening on %s", listen_path);
 
@@ -1456,20 +3765,35 @@ quit:
     if (opt_inotify)
       log_status("start inotify");
     pthread_mutex_lock(&mutex);
+    loaded.publish();
     detached_thread(manager, nullptr);
     pthread_mutex_unlock(&mutex);
+    FrameServer frames;
+    pool.init(request_threads, request_queue, queue_timeout, request_worker, request_cpus);
+    REP(i, LEN_OF(lane_names))
+      lane_ids[i] = pool.add_lane(lane_quota[i], lane_queue[i]);
+    TcpListener tcp;
+    if (tcp_listen.size()) {
+      tcp.init(tcp_listen.c_str(), tcp_acceptors, pool);
+      log_status("listening on tcp %s", tcp_listen.c_str());
+    }
+    if (frame_path.size()) {
+      frames.init(frame_path.c_str(), pool, request_size_limit, frame_inflight, process_request,
+                  [](const string& request) { return lane_ids[request_class(request)]; });
+      log_status("listening for framed requests on %s", frame_path.c_str());
+    }
 
     while (request_count) {
-      struct pollfd fds[2];
+      struct pollfd fds[4];
       fds[0].fd = sockfd;
-      fds[0].events = POLLIN;
-      int nfds = 1;
-      if (inotify_fd >= 0) {
-        fds[1].fd = inotify_fd;
-        fds[1].events = POLLIN;
-        nfds = 2;
-      }
-      int ready = poll(fds, nfds, -1);
+      fds[0].events = pool.full() ? 0 : POLLIN; // leave clients in the listen backlog
+      fds[1].fd = pool.wake_fd();
+      fds[1].events = POLLIN;
+      fds[2].fd = frames.fd();
+      fds[2].events = POLLIN;
+      fds[3].fd = inotify_fd; // poll ignores negative fds
+      fds[3].events = POLLIN;
+      int ready = poll(fds, LEN_OF(fds), -1);
       if (ready < 0) {
         if (errno == EINTR) continue;
         err_exit(EX_OSERR, "poll");
@@ -1477,27 +3801,34 @@ quit:
       if (fds[0].revents & POLLIN) { // socket
         int connfd = accept(sockfd, NULL, NULL);
         if (connfd < 0) err_exit(EX_OSERR, "accept");
-        pthread_mutex_lock(&mutex);
-        detached_thread(request_worker, (void*)(intptr_t)connfd);
-        pthread_mutex_unlock(&mutex);
+        pool.push(connfd);
         if (request_count > 0) request_count--;
       }
-      if (1 < nfds && fds[1].revents & POLLIN) // inotifyfd
+      if (fds[1].revents & POLLIN) {
+        pool.woken();
+        frames.resume();
+      }
+      if (fds[2].revents & POLLIN)
+        frames.process();
+      if (fds[3].revents & POLLIN) // inotifyfd
         process_inotify();
     }
     if (inotify_fd >= 0)
       close(inotify_fd);
     close(sockfd);
-    // destructors should be called after all readers & writers of RefCountTreap have finished
+    tcp.stop();
+    pool.stop();
+    if (pool.expired)
+      log_status("dropped %ld connections that waited too long for a thread", pool.expired.load());
+    if (pool.shed)
+      log_status("shed %ld requests whose class queue was full", pool.shed.load());
+    // destructors should be called after all readers & writers of the catalog have finished
     pthread_mutex_lock(&mutex);
     manager_quit = true;
     pthread_cond_signal(&manager_cond);
     while (pending > 0)
       pthread_cond_wait(&pending_empty, &mutex);
     pthread_mutex_unlock(&mutex);
-    for (auto x: loaded.roots)
-      if (x)
-        x->unref();
     loaded.clear();
   }
 }
@@ -1508,11 +3839,13 @@ int main(int argc, char *argv[])
   static struct option long_options[] = {
     {"autocomplete-length", required_argument, 0,   2},
     {"autocomplete-limit",  required_argument, 0,   3},
+    {"autocomplete-budget", required_argument, 0,   6},
     {"data-suffix",         required_argument, 0,   's'},
     {"fmindex-sample-rate", required_argument, 0,   4},
     {"force-rebuild",       no_argument,       0,   'f'},
     {"help",                no_argument,       0,   'h'},
     {"indexer-limit",       required_argument, 0,   'P'},
+    {"no-reverse-index",    no_argument,       0,   7},
     {"index-suffix",        required_argument, 0,   'S'},
     {"oneshot",             no_argument,       0,   'o'},
     {"path",                required_argument, 0,   'p'},
@@ -1520,6 +3853,36 @@ int main(int argc, char *argv[])
     {"request-count",       required_argument, 0,   'c'},
     {"request-timeout",     required_argument, 0,   't'},
     {"rrr-sample-rate",     required_argument, 0,   5},
+    {"search-budget",       required_argument, 0,   8},
+    {"approx-cpu-limit",    required_argument, 0,   9},
+    {"approx-max-distance", required_argument, 0,   10},
+    {"batch-threads",       required_argument, 0,   11},
+    {"request-size-limit",  required_argument, 0,   12},
+    {"left-context",        required_argument, 0,   13},
+    {"right-context",       required_argument, 0,   14},
+    {"aggregate-sample",    required_argument, 0,   15},
+    {"no-payload-index",    no_argument,       0,   16},
+    {"context-from-index",  no_argument,       0,   17},
+    {"pack-file-limit",     required_argument, 0,   18},
+    {"pack-min-files",      required_argument, 0,   19},
+    {"pack-size-limit",     required_argument, 0,   20},
+    {"request-threads",     required_argument, 0,   21},
+    {"request-queue",       required_argument, 0,   22},
+    {"queue-timeout",       required_argument, 0,   23},
+    {"frame-path",          required_argument, 0,   24},
+    {"frame-inflight",      required_argument, 0,   25},
+    {"lane-quota",          required_argument, 0,   26},
+    {"lane-queue",          required_argument, 0,   27},
+    {"lane-deadline",       required_argument, 0,   28},
+    {"build-cpus",          required_argument, 0,   29},
+    {"request-cpus",        required_argument, 0,   30},
+    {"build-nice",          required_argument, 0,   31},
+    {"build-ioprio",        required_argument, 0,   32},
+    {"throttle-p99",        required_argument, 0,   33},
+    {"tcp-listen",          required_argument, 0,   34},
+    {"tcp-acceptors",       required_argument, 0,   35},
+    {"backend",             required_argument, 0,   36},
+    {"backend-timeout",     required_argument, 0,   37},
     {0,                     0,                 0,   0},
   };
 
@@ -1546,6 +3909,104 @@ int main(int argc, char *argv[])
     case 5:
       rrr_sample_rate = get_long(optarg);
       break;
+    case 6:
+      autocomplete_budget = get_long(optarg);
+      break;
+    case 7:
+      opt_reverse_index = false;
+      break;
+    case 8:
+      search_budget = get_long(optarg);
+      break;
+    case 9:
+      approx_cpu_limit = get_double(optarg);
+      break;
+    case 10:
+      approx_max_distance = get_long(optarg);
+      break;
+    case 11:
+      batch_threads = get_long(optarg);
+      break;
+    case 12:
+      request_size_limit = get_long(optarg);
+      break;
+    case 13:
+      left_context = get_long(optarg);
+      break;
+    case 14:
+      right_context = get_long(optarg);
+      break;
+    case 15:
+      aggregate_sample = get_long(optarg);
+      break;
+    case 16:
+      opt_payload_index = false;
+      break;
+    case 17:
+      opt_context_from_index = true;
+      break;
+    case 18:
+      pack_file_limit = get_long(optarg);
+      break;
+    case 19:
+      pack_min_files = get_long(optarg);
+      break;
+    case 20:
+      pack_size_limit = get_long(optarg);
+      break;
+    case 21:
+      request_threads = get_long(optarg);
+      break;
+    case 22:
+      request_queue = get_long(optarg);
+      break;
+    case 23:
+      queue_timeout = get_double(optarg);
+      break;
+    case 24:
+      frame_path = optarg;
+      break;
+    case 25:
+      frame_inflight = get_long(optarg);
+      break;
+    case 26:
+      get_lane_values(optarg, [](long lane, const char *x) { lane_quota[lane] = get_long(x); });
+      break;
+    case 27:
+      get_lane_values(optarg, [](long lane, const char *x) { lane_queue[lane] = get_long(x); });
+      break;
+    case 28:
+      get_lane_values(optarg, [](long lane, const char *x) { lane_deadline[lane] = get_double(x); });
+      break;
+    case 29:
+      build_cpus = get_cpus(optarg);
+      break;
+    case 30:
+      request_cpus = get_cpus(optarg);
+      break;
+    case 31:
+      build_nice = get_long(optarg);
+      break;
+    case 32:
+      build_ioprio = strcmp(optarg, "idle") ? get_long(optarg) : -1;
+      if (build_ioprio < -1 || build_ioprio > 7)
+        err_exit(EX_USAGE, "--build-ioprio: 0 to 7 or idle");
+      break;
+    case 33:
+      throttle_p99 = get_double(optarg);
+      break;
+    case 34:
+      tcp_listen = optarg;
+      break;
+    case 35:
+      tcp_acceptors = get_long(optarg);
+      break;
+    case 36:
+      backends.push_back(optarg);
+      break;
+    case 37:
+      backend_timeout = get_double(optarg);
+      break;
     case 'c':
       request_count = get_long(optarg);
       break;
@@ -1584,13 +4045,29 @@ int main(int argc, char *argv[])
       break;
     }
   }
-  if (data_dir.empty())
+  if (data_dir.empty() && backends.empty())
     print_help(stderr);
   if (! indexer_limit) {
     indexer_limit = sysconf(_SC_NPROCESSORS_ONLN);
     if (indexer_limit < 0)
       err_exit(EX_OSERR, "sysconf");
   }
+  if (! batch_threads)
+    batch_threads = indexer_limit;
+  if (! request_threads) {
+    // a worker also blocks reading the request and writing the response
+    request_threads = 2*sysconf(_SC_NPROCESSORS_ONLN);
+    if (request_threads < 0)
+      err_exit(EX_OSERR, "sysconf");
+  }
+  if (! tcp_acceptors)
+    tcp_acceptors = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
+  REP(i, LEN_OF(lane_names)) {
+    if (! lane_quota[i])
+      lane_quota[i] = max(i == LANE_AUTOCOMPLETE ? request_threads : i == LANE_SEARCH ? request_threads/2 : request_threads/4, 1L);
+    if (! lane_queue[i])
+      lane_queue[i] = request_queue;
+  }
 
   RRRTable::init();
 
@@ -1601,9 +4078,22 @@ int main(int argc, char *argv[])
   puts(BOLD_CYAN "Data & index files:");
   B(opt_inotify);
   B(opt_recursive);
+  B(opt_reverse_index);
+  B(opt_payload_index);
+  B(opt_context_from_index);
   S(data_suffix);
   S(index_suffix);
   I(indexer_limit);
+  printf("build_cpus:");
+  for (int cpu: build_cpus)
+    printf(" %d", cpu);
+  puts("");
+  I(build_nice);
+  I(build_ioprio);
+  D(throttle_p99);
+  I(pack_file_limit);
+  I(pack_min_files);
+  I(pack_size_limit);
   printf("data_dir:");
   for (auto dir: data_dir)
     printf(" %s", dir);
@@ -1612,8 +4102,35 @@ int main(int argc, char *argv[])
   puts("\nRequests:");
   I(autocomplete_length);
   I(autocomplete_limit);
+  I(autocomplete_budget);
   I(search_limit);
+  I(search_budget);
+  D(approx_cpu_limit);
+  I(approx_max_distance);
   D(request_timeout);
+  I(request_size_limit);
+  I(request_threads);
+  printf("request_cpus:");
+  for (int cpu: request_cpus)
+    printf(" %d", cpu);
+  puts("");
+  I(request_queue);
+  D(queue_timeout);
+  S(frame_path);
+  I(frame_inflight);
+  S(tcp_listen);
+  I(tcp_acceptors);
+  printf("backends:");
+  for (auto& backend: backends)
+    printf(" %s", backend.c_str());
+  puts("");
+  D(backend_timeout);
+  REP(i, LEN_OF(lane_names))
+    printf("lane %s: quota %ld, queue %ld, deadline %lg\n", lane_names[i], lane_quota[i], lane_queue[i], lane_deadline[i]);
+  I(batch_threads);
+  I(left_context);
+  I(right_context);
+  I(aggregate_sample);
 
   puts("\nSuccinct data structures:");
   I(fmindex_sample_rate);
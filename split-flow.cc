@@ -3,14 +3,6 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 
-#if __WORDSIZE == 32
-const char MAGIC[] = {'A','P','A','P'};
-#elif __WORDSIZE == 64
-const char MAGIC[] = {'A','A','P','P','A','A','P','P'};
-#else
-# error "not supported"
-#endif
-
 const char *listen_path = "/tmp/flow.sock";
 string pcap_suffix = ".cap";
 string ap_suffix = ".ap";
@@ -18,11 +10,19 @@ vector<const char *> pcap_dir;
 long splitter_limit = 0;
 double request_timeout = 1;
 long request_count = -1;
+long request_size_limit = 1L << 20;
 bool opt_force_rebuild = false;
 bool opt_inotify = true;
 bool opt_recursive = false;
+bool opt_compress = false;
+long frame_size = 1L << 16;
 long left_context = 10;
 long right_context = 10;
+long request_threads = 0;
+long request_queue = 64;
+double queue_timeout = 1;
+string tcp_listen;
+long tcp_acceptors = 0;
 
 int inotify_fd = -1, pending = 0, pending_splitters = 0;
 map<int, string> wd2dir;
@@ -41,6 +41,9 @@ struct Entry
   int pcap_fd, ap_fd;
   off_t pcap_size, ap_size;
   void *pcap_mmap, *ap_mmap;
+  bool pcapng;
+  double tsresol; // of pcapng timestamps
+  ApFile ap;
   ~Entry() {
     if (pcap_mmap != MAP_FAILED)
       munmap(pcap_mmap, pcap_size);
@@ -53,34 +56,7 @@ struct Entry
       close(ap_fd);
   }
 };
-RefCountTreap<string, shared_ptr<Entry>> loaded;
-
-struct ApHeader {
-  char magic[sizeof(MAGIC)];
-  int n_flows;
-  off_t pcap_size;
-  off_t flow_offsets[0];
-} __attribute__((packed));
-
-struct FlowKey {
-  u32 client_ip, server_ip;
-  u16 client_port, server_port;
-  bool operator<(const FlowKey& rhs) const {
-    if (client_ip != rhs.client_ip) return client_ip < rhs.client_ip;
-    if (server_ip != rhs.server_ip) return server_ip < rhs.server_ip;
-    if (client_port != rhs.client_port) return client_port < rhs.client_port;
-    return server_port < rhs.server_port;
-  }
-};
-
-struct FlowPacket {
-  off_t pcap_offset, pcap_payload_offset, ap_offset, len;
-  bool from_server;
-  bool operator<(const FlowPacket& o) const {
-    if (pcap_offset != o.pcap_offset) return pcap_offset < o.pcap_offset;
-    return from_server < o.from_server;
-  }
-} __attribute__((packed));
+Catalog<shared_ptr<Entry>> loaded;
 
 struct FlowVal {
   FlowKey key;
@@ -90,13 +66,6 @@ struct FlowVal {
   vector<FlowPacket> packets;
 };
 
-struct FlowHeader {
-  FlowKey key;
-  u32 unix_time;
-  int n_packets;
-  FlowPacket packets[0];
-} __attribute__((packed));
-
 void print_help(FILE *fh)
 {
   fprintf(fh, "Usage: %s [OPTIONS] dir\n", program_invocation_short_name);
@@ -112,6 +81,14 @@ void print_help(FILE *fh)
         "  -s, --pcap-suffix %s      data file suffix. (default: .cap)\n"
         "  -S, --ap-suffix %s        index file suffix. (default: .ap)\n"
         "  -t, --request-timeout %lf clients idle for more than T seconds will be dropped (default: 1)\n"
+        "  --request-size-limit %ld  max number of bytes of a request (default: 1048576)\n"
+        "  --compress                write .ap files as seekable block-compressed containers\n"
+        "  --frame-size %ld          bytes of a compressed frame (default: 65536)\n"
+        "  --request-threads %ld     number of threads serving requests, pinned to CPUs (default: twice the number of CPUs)\n"
+        "  --request-queue %ld       max number of connections waiting for a thread, others wait in the listen backlog (default: 64)\n"
+        "  --queue-timeout %lf       connections that waited for a thread longer than T seconds are closed unserved (default: 1)\n"
+        "  --tcp-listen %s           also accept requests over TCP on [HOST:]PORT (HOST defaults to 127.0.0.1, IPv6 in brackets)\n"
+        "  --tcp-acceptors %ld       number of threads accepting TCP connections, each on its own SO_REUSEPORT socket (default: number of CPUs)\n"
         "  -h, --help                display this help and exit\n"
         "\n"
         "Examples:\n"
@@ -119,22 +96,6 @@ void print_help(FILE *fh)
   exit(fh == stdout ? 0 : EX_USAGE);
 }
 
-ssize_t write_all(int fd, const void* buf, size_t count)
-{
-  auto* a = (const u8*)buf;
-  ssize_t r;
-  while (count > 0) {
-    r = write(fd, buf, count);
-    if (r < 0) {
-      if (errno == EINTR) continue;
-      return -1;
-    }
-    a += r;
-    count -= r;
-  }
-  return count;
-}
-
 string escape(u8* a, off_t len)
 {
   const char ab[] = "0123456789abcdef";
@@ -170,8 +131,6 @@ string to_path(string path, string name)
   return path;
 }
 
-template<> vector<RefCountTreap<string, shared_ptr<Entry>>::Node*> RefCountTreap<string, shared_ptr<Entry>>::roots{};
-
 void detached_thread(void* (*start_routine)(void*), void* data)
 {
   pending++;
@@ -272,8 +231,7 @@ public:
         if (block[i+4] & 0x80)
           tsresol = pow(0.5, block[i+4] & 0x7f);
         else
-          /// XXX
-          tsresol = pow(0.1, block[i+4]-3);
+          tsresol = pow(0.1, block[i+4]);
         break;
       case 14: // if_tsoffset
         err_msg("offset %u: option code %d not implemented", i, opt_code);
@@ -325,6 +283,22 @@ public:
   }
 };
 
+// if_tsresol of the first interface of a pcapng file
+double pcapng_tsresol(const u8 *a, off_t len)
+{
+  PCAPNG pcapng;
+  for (off_t i = 0; len-i >= 12; ) {
+    u32 type = *(u32*)(a+i), block_len = *(u32*)(a+i+4);
+    if (block_len < 12 || len-i < block_len) break;
+    if (type == 0x00000001) {
+      pcapng.parse_interface_description_block(block_len, a+i);
+      break;
+    }
+    i += block_len;
+  }
+  return pcapng.tsresol;
+}
+
 void split(void* pcap_mmap, off_t pcap_size, FILE* fh)
 {
   PCAP* pcap = NULL;
@@ -403,7 +377,7 @@ void split(void* pcap_mmap, off_t pcap_size, FILE* fh)
   {
     // APHeader
     ApHeader ap_hdr;
-    memcpy(ap_hdr.magic, MAGIC, sizeof MAGIC);
+    memcpy(ap_hdr.magic, AP_MAGIC, sizeof AP_MAGIC);
     ap_hdr.n_flows = flow.size();
     ap_hdr.pcap_size = pcap_size;
     if (fwrite(&ap_hdr, sizeof ap_hdr, 1, fh) != 1)
@@ -468,19 +442,24 @@ void* splitter(void* pcap_path_)
     if (! ap_size) goto rebuild;
     if ((ap_mmap = mmap(NULL, ap_size, PROT_READ, MAP_SHARED, ap_fd, 0)) == MAP_FAILED)
       goto quit;
-    auto ap_hdr = (ApHeader*)ap_mmap;
-    if (ap_size < sizeof(ApHeader) || memcmp(ap_hdr->magic, MAGIC, sizeof(MAGIC)))
+    ApFile ap;
+    if (! ap.init(ap_mmap, ap_size))
       log_status("ap file %s: bad magic, rebuilding", ap_path.c_str());
-    else if (ap_hdr->pcap_size != pcap_size)
+    else if (ap.header()->pcap_size != pcap_size)
       log_status("ap file %s: mismatching length of pcap file, rebuilding", ap_path.c_str());
+    else if (ap.compressed() != opt_compress)
+      log_status("ap file %s: mismatching compression, rebuilding", ap_path.c_str());
     else if (! opt_force_rebuild)
       goto load;
   }
 rebuild:
+  pthread_mutex_lock(&mutex);
   if (loaded.find(*pcap_path)) {
     loaded.erase(*pcap_path);
+    pthread_cond_signal(&manager_cond);
     log_action("rebuilding flows of '%s", pcap_path->c_str());
   }
+  pthread_mutex_unlock(&mutex);
   {
     StopWatch sw;
     if (ap_mmap != MAP_FAILED) {
@@ -489,8 +468,27 @@ rebuild:
     }
     if (! (fh = fdopen(ap_fd, "r+")))
       goto quit;
-    split(pcap_mmap, pcap_size, fh);
-    ap_size = ftello(fh);
+    if (opt_compress) {
+      // split to a temporary file, then compress it frame by frame
+      FILE* raw = tmpfile();
+      void* raw_mmap = MAP_FAILED;
+      off_t raw_size;
+      if (! raw)
+        goto quit;
+      split(pcap_mmap, pcap_size, raw);
+      raw_size = ftello(raw);
+      if (raw_size > 0 && (raw_mmap = mmap(NULL, raw_size, PROT_READ, MAP_SHARED, fileno(raw), 0)) == MAP_FAILED) {
+        fclose(raw);
+        goto quit;
+      }
+      if (! apz_write(fh, (const u8*)raw_mmap, raw_size, frame_size, Z_DEFAULT_COMPRESSION))
+        err_exit(EX_IOERR, "failed to write %s", ap_path.c_str());
+      if (raw_mmap != MAP_FAILED)
+        munmap(raw_mmap, raw_size);
+      fclose(raw);
+    } else
+      split(pcap_mmap, pcap_size, fh);
+    ap_size = lseek(ap_fd, 0, SEEK_END);
     log_action("created flows of %s. data: %ld, index: %ld, used %.3lf s", pcap_path->c_str(), pcap_size, ap_size, sw.elapsed());
   }
 load:
@@ -509,6 +507,9 @@ load:
     entry->ap_size = ap_size;
     entry->pcap_mmap = pcap_mmap;
     entry->ap_mmap = ap_mmap;
+    entry->pcapng = pcap_size >= 4 && *(u32*)pcap_mmap == 0x0a0d0d0a;
+    entry->tsresol = entry->pcapng ? pcapng_tsresol((u8*)pcap_mmap, pcap_size) : 1e-6;
+    entry->ap.init(ap_mmap, ap_size);
     pthread_mutex_lock(&mutex);
     loaded.insert(ap_path, entry);
     pthread_cond_signal(&manager_cond);
@@ -627,107 +628,186 @@ void process_inotify()
     }
 }
 
-void locate(int connfd, const char* cmd, const Entry* entry, off_t offset, off_t len)
+// writes the packets of flows (entry, flow index), deduplicated and ordered by time, as one classic pcap
+// packet records are written with writev straight from pcap_mmap; pcapng packets get a synthesized record header
+void carve(int connfd, vector<pair<const Entry*, long>> flows)
 {
-  auto* ap_hdr = (ApHeader*)entry->ap_mmap;
-  if (! ap_hdr || offset < 0 || entry->ap_size <= offset) return;
-  off_t* flow_offset = upper_bound(ap_hdr->flow_offsets, ap_hdr->flow_offsets+ap_hdr->n_flows, offset);
-  if (flow_offset == ap_hdr->flow_offsets) return;
-  flow_offset--;
-  auto* flow_hdr = (FlowHeader*)((u8*)entry->ap_mmap+*flow_offset);
-  long pi = upper_bound(flow_hdr->packets, flow_hdr->packets+flow_hdr->n_packets, FlowPacket{offset, LONG_MAX, true}) - flow_hdr->packets;
-  if (! pi) return;
-  pi--;
-
-  if (! strcmp(cmd, "context")) {
-    string left, body, right;
-    long nleft = 0, nbody = 0, nright = 0, epoch = 0, sport = 0, dport = 0;
-    {
-      off_t po = offset-flow_hdr->packets[pi].ap_offset;
-      auto i = pi;
-      for (; i < flow_hdr->n_packets && nbody < len; i++, po = 0) {
-        auto t = min(flow_hdr->packets[i].len-po, len-nbody);
-        if (! t) continue;
-        if (flow_hdr->packets[i].from_server)
-          body += "<span class=\"red highlight\">";
-        else
-          body += "<span class=\"green highlight\">";
-        body += escape((u8*)entry->ap_mmap+flow_hdr->packets[i].ap_offset+po, t);
-        body += "</span>";
-        po += t;
-        if ((nbody += t) == len) break;
-      }
-      for (; i < flow_hdr->n_packets && nright < right_context; i++, po = 0) {
-        auto t = min(flow_hdr->packets[i].len-po, right_context-nright);
-        if (! t) continue;
-        if (flow_hdr->packets[i].from_server)
-          right += "<span class=\"red\">";
-        else
-          right += "<span class=\"green\">";
-        right += escape((u8*)entry->ap_mmap+flow_hdr->packets[i].ap_offset+po, t);
-        right += "</span>";
-      }
-      po = offset-flow_hdr->packets[pi].ap_offset;
-      vector<string> lefts;
-      for (i = pi; nleft < left_context; ) {
-        auto t = min(po, left_context-nleft);
-        if (t) {
-          lefts.emplace_back("</span>");
-          lefts.emplace_back(escape((u8*)entry->ap_mmap+flow_hdr->packets[i].ap_offset+po-t, t));
-          if (flow_hdr->packets[i].from_server)
-            lefts.emplace_back("<span class=\"red\">");
-          else
-            lefts.emplace_back("<span class=\"green\">");
-        }
-        if (! i) break;
-        po = flow_hdr->packets[--i].len;
-      }
-      for (auto it = lefts.rbegin(); it != lefts.rend(); ++it)
-        left += *it;
+  struct Packet {
+    double timestamp;
+    const Entry* entry;
+    off_t pcap_offset;
+    bool operator<(const Packet& o) const {
+      if (timestamp != o.timestamp) return timestamp < o.timestamp;
+      if (entry != o.entry) return entry < o.entry;
+      return pcap_offset < o.pcap_offset;
     }
-    dprintf(connfd, "%" PRIu32 "\t%" PRIu16 "\t%" PRIu16 "\t%s", flow_hdr->unix_time, flow_hdr->key.client_port, flow_hdr->key.server_port, (left+body+right).c_str());
-  } else if (! strcmp(cmd, "pcap")) {
-    const char global_header[] = "\xd4\xc3\xb2\xa1\x02\x00\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff\xff\x00\x00\x01\x00\x00\x00";
-    write_all(connfd, global_header, sizeof(global_header)-1);
-    off_t po = offset-flow_hdr->packets[pi].ap_offset;
+    bool operator==(const Packet& o) const { return entry == o.entry && pcap_offset == o.pcap_offset; }
+  };
+  sort(flows.begin(), flows.end());
+  flows.erase(unique(flows.begin(), flows.end()), flows.end());
+  vector<Packet> packets;
+  for (auto& f: flows) {
+    if (f.first->pcap_mmap == MAP_FAILED || ! f.first->ap.valid()) continue;
+    auto* flow_hdr = f.first->ap.flow(f.second);
     REP(i, flow_hdr->n_packets) {
-      // TODO PCAPNG
-      auto* block = (u8*)entry->pcap_mmap+flow_hdr->packets[i].pcap_offset;
-      u64 timestamp = (u64(*(u32*)&block[12]) << 32 | *(u32*)&block[16]) * tsresol;
-      write_all(connfd, block, *(u32*)(block+4));
+      off_t o = flow_hdr->packets[i].pcap_offset;
+      auto* block = (u8*)f.first->pcap_mmap+o;
+      double timestamp = f.first->pcapng
+        ? (u64(*(u32*)&block[12]) << 32 | *(u32*)&block[16]) * f.first->tsresol
+        : *(u32*)&block[0] + *(u32*)&block[4] * 1e-6;
+      packets.push_back(Packet{timestamp, f.first, o});
+    }
+  }
+  sort(packets.begin(), packets.end());
+  packets.erase(unique(packets.begin(), packets.end()), packets.end());
+
+  const char global_header[] = "\xd4\xc3\xb2\xa1\x02\x00\x04\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff\xff\x00\x00\x01\x00\x00\x00";
+  if (write_all(connfd, global_header, sizeof(global_header)-1) < 0) return;
+  const long BATCH = 512;
+  u32 headers[BATCH][4];
+  iovec iov[BATCH*2];
+  for (long i = 0; i < packets.size(); ) {
+    long n = 0;
+    for (long k = 0; k < BATCH && i < packets.size(); k++, i++) {
+      auto& p = packets[i];
+      auto* block = (u8*)p.entry->pcap_mmap+p.pcap_offset;
+      if (p.entry->pcapng) {
+        // Enhanced Packet Block: captured length at 20, original length at 24, data at 28
+        headers[k][0] = u32(p.timestamp);
+        headers[k][1] = u32((p.timestamp-headers[k][0])*1e6);
+        headers[k][2] = *(u32*)&block[20];
+        headers[k][3] = *(u32*)&block[24];
+        iov[n++] = iovec{headers[k], sizeof headers[k]};
+        iov[n++] = iovec{block+28, headers[k][2]};
+      } else
+        iov[n++] = iovec{block, 16+*(u32*)&block[8]};
     }
+    if (writev_all(connfd, iov, n) < 0) return;
   }
 }
 
-void* request_worker(void* connfd_)
+void locate(int connfd, const char* cmd, const Entry* entry, off_t offset, off_t len)
 {
-  int connfd = intptr_t(connfd_);
-  char buf[BUF_SIZE] = {};
-  const char *p, *filename, *pos;
-  int nread = 0;
-  timespec timeout;
+  auto& ap = entry->ap;
+  long fi;
+  if ((fi = ap.flow_of(offset)) < 0) return;
+  auto* flow_hdr = ap.flow(fi);
+
+  if (! strcmp(cmd, "context")) {
+    string context;
+    ap.context(fi, offset, len, left_context, right_context, context);
+    dprintf(connfd, "%" PRIu32 "\t%" PRIu16 "\t%" PRIu16 "\t%s", flow_hdr->unix_time, flow_hdr->key.client_port, flow_hdr->key.server_port, context.c_str());
+  } else if (! strcmp(cmd, "pcap"))
+    carve(connfd, {make_pair(entry, fi)});
+}
+
+// scanf conversion of a filename field of at most BUF_SIZE-1 bytes
+const string filename_field = "%"+to_string(BUF_SIZE-1)+"[^\t]";
+
+// contexts \0 (filename \t offset \t len \n)*
+// prints epoch \t client_port \t server_port \t context \n for each tuple in order, an empty line if not found or malformed
+void locate_batch(int connfd, const char* tuples, const char* end)
+{
+  struct Tuple {
+    string filename; // empty if malformed
+    off_t offset, len;
+    long i;
+  };
+  vector<Tuple> ts;
+  auto lines = split_lines(end-tuples, tuples);
+  if (lines.size() && lines.back().empty())
+    lines.pop_back();
+  for (auto& line: lines) {
+    char filename[BUF_SIZE];
+    long offset, len;
+    if (sscanf(line.c_str(), (filename_field+"\t%ld\t%ld").c_str(), filename, &offset, &len) == 3)
+      ts.push_back(Tuple{filename, offset, len, long(ts.size())});
+    else
+      ts.push_back(Tuple{"", 0, 0, long(ts.size())});
+  }
+  // group by file, then answer in request order
+  vector<long> order(ts.size());
+  REP(i, ts.size())
+    order[i] = i;
+  sort(order.begin(), order.end(), [&](long x, long y) { return ts[x].filename < ts[y].filename; });
+
+  vector<shared_ptr<Entry>> entries(order.size());
   {
-    double tmp;
-    timeout.tv_sec = modf(request_timeout, &tmp);
-    timeout.tv_nsec = tmp;
+    EpochGuard guard;
+    auto& snapshot = loaded.snapshot();
+    for (long k = 0; k < order.size(); k++) {
+      auto& t = ts[order[k]];
+      if (t.filename.empty())
+        continue;
+      if (k && t.filename == ts[order[k-1]].filename)
+        entries[k] = entries[k-1];
+      else if (auto* entry = snapshot.find(t.filename))
+        entries[k] = *entry;
+    }
   }
 
-  struct pollfd fds;
-  fds.fd = connfd;
-  fds.events = POLLIN;
-  for(;;) {
-    int ready = ppoll(&fds, 1, &timeout, NULL);
-    if (ready < 0) {
-      if (errno == EINTR) continue;
-      goto quit;
+  vector<string> res(ts.size());
+  for (long k = 0; k < order.size(); k++) {
+    auto& t = ts[order[k]];
+    long fi;
+    if (! entries[k] || (fi = entries[k]->ap.flow_of(t.offset)) < 0) continue;
+    auto& ap = entries[k]->ap;
+    auto* flow_hdr = ap.flow(fi);
+    char buf[BUF_SIZE];
+    snprintf(buf, sizeof buf, "%" PRIu32 "\t%" PRIu16 "\t%" PRIu16 "\t", u32(flow_hdr->unix_time), u16(flow_hdr->key.client_port), u16(flow_hdr->key.server_port));
+    res[order[k]] = buf;
+    ap.context(fi, t.offset, t.len, left_context, right_context, res[order[k]]);
+  }
+
+  BufferedWriter out(connfd);
+  for (auto& x: res) {
+    out.buf += x;
+    out.buf += '\n';
+    if (! out.maybe_flush()) break;
+  }
+  out.flush();
+}
+
+// pcaps \0 (filename \t offset \n)*
+// one pcap of all flows containing the offsets
+void carve_batch(int connfd, const char* tuples, const char* end)
+{
+  vector<shared_ptr<Entry>> held;
+  vector<pair<const Entry*, long>> flows;
+  {
+    EpochGuard guard;
+    auto& snapshot = loaded.snapshot();
+    for (auto& line: split_lines(end-tuples, tuples)) {
+      char filename[BUF_SIZE];
+      long offset, fi;
+      if (sscanf(line.c_str(), (filename_field+"\t%ld").c_str(), filename, &offset) != 2) continue;
+      auto* entry = snapshot.find(filename);
+      if (entry && (fi = (*entry)->ap.flow_of(offset)) >= 0) {
+        if (held.empty() || held.back() != *entry)
+          held.push_back(*entry);
+        flows.emplace_back(entry->get(), fi);
+      }
     }
-    if (! ready) goto quit; // timeout
-    ssize_t t = read(connfd, buf+nread, sizeof buf-nread);
-    if (t < 0) goto quit;
-    if (! t) break;
-    nread += t;
   }
+  carve(connfd, flows);
+}
+
+void request_worker(int connfd, double)
+{
+  string request;
+  char *buf;
+  const char *p, *filename, *pos;
+  long nread;
 
+  if (! read_request(connfd, request_timeout, request_size_limit, request))
+    goto quit;
+  buf = &request[0];
+  nread = request.size();
+
+  if (! strcmp(buf, "contexts") || ! strcmp(buf, "pcaps")) {
+    (buf[0] == 'c' ? locate_batch : carve_batch)(connfd, min(buf+strlen(buf)+1, buf+nread), buf+nread);
+    goto quit;
+  }
   for (p = buf; p < buf+nread && *p; p++);
   if (++p >= buf+nread) goto quit;
   filename = p;
@@ -743,45 +823,43 @@ void* request_worker(void* connfd_)
     if (! *end && ! errno) {
       ulong len = strtoul(p, &end, 0);
       if (! *end && ! errno) {
-        pthread_mutex_lock(&mutex);
-        auto* node = loaded.find(string(filename));
-        if (node) node->refcnt++;
-        pthread_mutex_unlock(&mutex);
-        if (node) {
-          locate(connfd, buf, node->val.get(), offset, len);
-          pthread_mutex_lock(&mutex);
-          node->unref();
-          pthread_mutex_unlock(&mutex);
+        shared_ptr<Entry> entry;
+        {
+          EpochGuard guard;
+          if (auto* x = loaded.snapshot().find(filename))
+            entry = *x;
         }
+        if (entry)
+          locate(connfd, buf, entry.get(), offset, len);
       }
     }
   }
 quit:
   close(connfd);
-  pthread_mutex_lock(&mutex);
-  if (! --pending)
-    pthread_cond_signal(&pending_empty);
-  pthread_mutex_unlock(&mutex);
-  return NULL;
 }
 
 void* manager(void*)
 {
   for(;;) {
     pthread_mutex_lock(&mutex);
-    while (! manager_quit && loaded.roots.empty() && (splitter_tasks.empty() || pending_splitters >= splitter_limit))
+    while (! manager_quit && ! loaded.dirty() && (splitter_tasks.empty() || pending_splitters >= splitter_limit))
       pthread_cond_wait(&manager_cond, &mutex);
     while (splitter_tasks.size() && pending_splitters < splitter_limit) {
       pending_splitters++;
       detached_thread(splitter, new string(splitter_tasks.back()));
       splitter_tasks.pop_back();
     }
-    while (loaded.roots.size()) {
-      if (loaded.roots.back())
-        loaded.roots.back()->unref();
-      loaded.roots.pop_back();
-    }
+    // one snapshot for all the changes since the last round, the replaced one is freed once no request can be reading it
+    if (loaded.dirty())
+      loaded.publish();
+    vector<decltype(loaded)::Snapshot*> retired;
+    retired.swap(loaded.retired);
     pthread_mutex_unlock(&mutex);
+    if (retired.size()) {
+      Epoch::synchronize();
+      for (auto x: retired)
+        delete x;
+    }
     if (manager_quit) break;
   }
   pthread_mutex_lock(&mutex);
@@ -805,7 +883,7 @@ void run()
     log_action("removed old socket %s", listen_path);
   if (bind(sockfd, (struct sockaddr *)&addr, sizeof addr) < 0)
     err_exit(EX_OSERR, "bind");
-  if (listen(sockfd, 1) < 0)
+  if (listen(sockfd, SOMAXCONN) < 0)
     err_exit(EX_OSERR, "listen");
   log_status("listening on %s", listen_path);
 
@@ -820,16 +898,25 @@ void run()
   pthread_mutex_lock(&mutex);
   detached_thread(manager, nullptr);
   pthread_mutex_unlock(&mutex);
+  WorkerPool pool;
+  pool.init(request_threads, request_queue, queue_timeout, request_worker);
+  TcpListener tcp;
+  if (tcp_listen.size()) {
+    tcp.init(tcp_listen.c_str(), tcp_acceptors, pool);
+    log_status("listening on tcp %s", tcp_listen.c_str());
+  }
 
   while (request_count) {
-    struct pollfd fds[2];
+    struct pollfd fds[3];
     fds[0].fd = sockfd;
-    fds[0].events = POLLIN;
-    int nfds = 1;
+    fds[0].events = pool.full() ? 0 : POLLIN; // leave clients in the listen backlog
+    fds[1].fd = pool.wake_fd();
+    fds[1].events = POLLIN;
+    int nfds = 2;
     if (inotify_fd >= 0) {
-      fds[1].fd = inotify_fd;
-      fds[1].events = POLLIN;
-      nfds = 2;
+      fds[2].fd = inotify_fd;
+      fds[2].events = POLLIN;
+      nfds = 3;
     }
     int ready = poll(fds, nfds, -1);
     if (ready < 0) {
@@ -839,17 +926,21 @@ void run()
     if (fds[0].revents & POLLIN) { // socket
       int connfd = accept(sockfd, NULL, NULL);
       if (connfd < 0) err_exit(EX_OSERR, "accept");
-      pthread_mutex_lock(&mutex);
-      detached_thread(request_worker, (void*)(intptr_t)connfd);
-      pthread_mutex_unlock(&mutex);
+      pool.push(connfd);
       if (request_count > 0) request_count--;
     }
-    if (1 < nfds && fds[1].revents & POLLIN) // inotifyfd
+    if (fds[1].revents & POLLIN)
+      pool.woken();
+    if (2 < nfds && fds[2].revents & POLLIN) // inotifyfd
       process_inotify();
   }
   if (inotify_fd >= 0)
     close(inotify_fd);
   close(sockfd);
+  tcp.stop();
+  pool.stop();
+  if (pool.expired)
+    log_status("dropped %ld connections that waited too long for a thread", pool.expired.load());
   pthread_mutex_lock(&mutex);
   manager_quit = true;
   pthread_cond_signal(&manager_cond);
@@ -870,8 +961,16 @@ int main(int argc, char *argv[])
     {"pcap-suffix",         required_argument, 0,   's'},
     {"recursive",           no_argument,       0,   'r'},
     {"request-count",       required_argument, 0,   'c'},
+    {"request-size-limit",  required_argument, 0,   2},
     {"right-context",       required_argument, 0,   'R'},
     {"splitter-limit",      required_argument, 0,   'P'},
+    {"compress",            no_argument,       0,   3},
+    {"frame-size",          required_argument, 0,   4},
+    {"request-threads",     required_argument, 0,   5},
+    {"request-queue",       required_argument, 0,   6},
+    {"queue-timeout",       required_argument, 0,   7},
+    {"tcp-listen",          required_argument, 0,   8},
+    {"tcp-acceptors",       required_argument, 0,   9},
     {0,                     0,                 0,   0},
   };
 
@@ -886,6 +985,32 @@ int main(int argc, char *argv[])
       pcap_dir.push_back(optarg);
       break;
     }
+    case 2:
+      request_size_limit = get_long(optarg);
+      break;
+    case 3:
+      opt_compress = true;
+      break;
+    case 4:
+      frame_size = get_long(optarg);
+      if (frame_size <= 0 || frame_size > UINT32_MAX)
+        err_exit(EX_USAGE, "invalid frame size");
+      break;
+    case 5:
+      request_threads = get_long(optarg);
+      break;
+    case 6:
+      request_queue = get_long(optarg);
+      break;
+    case 7:
+      queue_timeout = get_double(optarg);
+      break;
+    case 8:
+      tcp_listen = optarg;
+      break;
+    case 9:
+      tcp_acceptors = get_long(optarg);
+      break;
     case 'c':
       request_count = get_long(optarg);
       break;
@@ -925,6 +1050,14 @@ int main(int argc, char *argv[])
     if (splitter_limit < 0)
       err_exit(EX_OSERR, "sysconf");
   }
+  if (! request_threads) {
+    // a worker also blocks reading the request and writing the response
+    request_threads = 2*sysconf(_SC_NPROCESSORS_ONLN);
+    if (request_threads < 0)
+      err_exit(EX_OSERR, "sysconf");
+  }
+  if (! tcp_acceptors)
+    tcp_acceptors = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
 
   run();
 }
@@ -0,0 +1,70 @@
+// CancelToken::check on Unix domain and TCP connections whose client half-closes after its request
+#include "../common.hh"
+
+static long failures = 0;
+
+static void expect(const char *what, int fd, bool cancelled) {
+  usleep(50000); // let the loopback deliver
+  CancelToken cancel(fd);
+  if (cancel.check() != cancelled) {
+    failures++;
+    fprintf(stderr, "%s: cancelled is %d, want %d\n", what, ! cancelled, cancelled);
+  }
+}
+
+// a connected pair (client, server) after the client has sent a request and half-closed
+static void connect_pair(int family, int& client, int& server) {
+  int sv[2];
+  if (family == AF_UNIX) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+      err_exit(EX_OSERR, "socketpair");
+  } else {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof addr;
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    if (l < 0 || bind(l, (sockaddr*)&addr, len) < 0 || listen(l, 1) < 0 || getsockname(l, (sockaddr*)&addr, &len) < 0)
+      err_exit(EX_OSERR, "listen");
+    if ((sv[0] = socket(AF_INET, SOCK_STREAM, 0)) < 0 || connect(sv[0], (sockaddr*)&addr, len) < 0 || (sv[1] = accept(l, NULL, NULL)) < 0)
+      err_exit(EX_OSERR, "connect");
+    close(l);
+  }
+  client = sv[0];
+  server = sv[1];
+  string req;
+  if (write(client, "0\0\0\0x", 5) != 5 || shutdown(client, SHUT_WR) < 0 || ! read_request(server, 1, 1 << 10, req))
+    err_exit(EX_OSERR, "request");
+}
+
+int main() {
+  for (int family: {AF_UNIX, AF_INET}) {
+    const char *name = family == AF_UNIX ? "unix" : "tcp";
+    int client, server;
+    char what[64];
+
+    connect_pair(family, client, server);
+    snprintf(what, sizeof what, "%s half-close", name);
+    expect(what, server, false);
+    close(client);
+    snprintf(what, sizeof what, "%s close", name);
+    // a TCP close after the half-close sends nothing: it shows once a response write draws a reset
+    if (family == AF_INET) {
+      expect(what, server, false);
+      if (write(server, "x", 1) != 1)
+        err_exit(EX_OSERR, "write");
+      snprintf(what, sizeof what, "%s close, then a write", name);
+    }
+    expect(what, server, true);
+    close(server);
+
+    connect_pair(family, client, server);
+    close_reset(client);
+    snprintf(what, sizeof what, "%s reset", name);
+    expect(what, server, true);
+    close(server);
+  }
+  if (failures)
+    fprintf(stderr, "cancel: %ld failures\n", failures);
+  return failures ? 1 : 0;
+}
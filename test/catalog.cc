@@ -0,0 +1,72 @@
+// Catalog::Snapshot::overlapping against a linear scan, with nested and interleaved ranges
+#include "../common.hh"
+
+static long failures = 0;
+
+static vector<string> overlapping(const Catalog<string>::Snapshot& snap, const string& lo, const string& hi) {
+  vector<string> res;
+  snap.overlapping(lo, hi, [&](const string& val) { res.push_back(val); });
+  return res;
+}
+
+static void expect(const Catalog<string>::Snapshot& snap, const map<string, string>& ranges, const string& lo, const string& hi) {
+  vector<string> want;
+  for (auto& x: ranges) // key -> low, by increasing key
+    if (x.second <= hi && lo <= x.first)
+      want.push_back(x.first);
+  auto got = overlapping(snap, lo, hi);
+  if (got != want) {
+    failures++;
+    fprintf(stderr, "[%s, %s]: got", lo.c_str(), hi.c_str());
+    for (auto& x: got)
+      fprintf(stderr, " %s", x.c_str());
+    fprintf(stderr, ", want");
+    for (auto& x: want)
+      fprintf(stderr, " %s", x.c_str());
+    fprintf(stderr, "\n");
+  }
+}
+
+static void check(const map<string, string>& ranges, const vector<pair<string, string>>& queries) {
+  Catalog<string> catalog;
+  for (auto& x: ranges)
+    catalog.insert(x.second, x.first, x.first);
+  catalog.publish();
+  for (auto& q: queries)
+    expect(catalog.snapshot(), ranges, q.first, q.second);
+}
+
+static string random_path(unsigned& seed, long len) {
+  string s;
+  REP(i, 1+rand_r(&seed)%len)
+    s += "ab/"[rand_r(&seed)%3];
+  return s;
+}
+
+int main() {
+  // a pack of x/ with a nested pack of its subdirectory x/m/, and a file of x/m/ indexed alone
+  check({{"x/z.ap", "x/a.ap"}, {"x/m/d.ap", "x/m/a.ap"}, {"x/m/e.ap", "x/m/e.ap"}},
+        {{"x/m/b.ap", "x/m/b.ap"}, {"", "x/m/b.ap"}, {"x/m/c.ap", "x/m/d.ap"}, {"x/m/e.ap", "x/n.ap"}, {"x/b.ap", "x/c.ap"},
+         {"y", "z"}, {"", "x/a"}});
+  // interleaved packs of one directory after a pack of the whole host
+  check({{"h/z", "h/a"}, {"h/d/y", "h/d/b"}, {"h/d/x", "h/d/a"}, {"h/d/z", "h/d/c"}},
+        {{"h/d/b0", "h/d/b0"}, {"h/d/a0", "h/d/a1"}, {"h/d/c0", "h/d/c0"}, {"", "h/d/a"}, {"h/d/x0", "h/e"}});
+
+  unsigned seed = 1;
+  REP(round, 2000) {
+    map<string, string> ranges;
+    REP(i, rand_r(&seed)%20) {
+      string a = random_path(seed, 6), b = random_path(seed, 6);
+      ranges[max(a, b)] = min(a, b);
+    }
+    vector<pair<string, string>> queries;
+    REP(i, 20) {
+      string a = random_path(seed, 6), b = random_path(seed, 6);
+      queries.emplace_back(min(a, b), max(a, b));
+    }
+    check(ranges, queries);
+  }
+  if (failures)
+    fprintf(stderr, "catalog: %ld failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -17,7 +17,9 @@ rescue LoadError => e
   exit 1
 end
 
+# paths of UNIX domain sockets, or host:port of the daemons' --tcp-listen
 SEARCH_SOCK = '/tmp/search.sock'
+FLOW_SOCK = '/tmp/flow.sock'
 SEARCH_TIMEOUT = 30
 MAX_PAGES = 30
 PER_PAGE = 20
@@ -38,6 +40,47 @@ set :port, 4568
 
 set :views, sass: 'css', coffee: 'js', :default => 'html'
 
+# \-escapes understood by indexer, with octal and single-letter escapes spelled as \x??
+def escape_query q
+  q.gsub(/\\[0-7]{1,3}/) {|match|
+    "\\x#{'%02x' % match[1..-1].to_i(8)}"
+  }
+  .gsub('\\\\', '\\x5c')
+  .gsub('\\a', '\\x07')
+  .gsub('\\b', '\\x08')
+  .gsub('\\t', '\\x09')
+  .gsub('\\n', '\\x0a')
+  .gsub('\\v', '\\x0b')
+  .gsub('\\f', '\\x0c')
+  .gsub('\\r', '\\x0d')
+end
+
+# a reset rather than a FIN, so that indexer cancels the abandoned request over TCP too
+def hang_up sock
+  sock.setsockopt Socket::Option.linger(true, 0)
+  sock.close
+end
+
+def open_socket addr
+  if addr.start_with? '/'
+    sock = Socket.new Socket::AF_UNIX, Socket::SOCK_STREAM, 0
+    sock.connect Socket.pack_sockaddr_un(addr)
+    sock
+  else
+    host, _, port = addr.rpartition ':'
+    TCPSocket.new host.delete('[]'), port.to_i
+  end
+end
+
+def unix_request path, req
+  sock = open_socket path
+  sock.write req
+  sock.close_write
+  res = sock.read
+  sock.close
+  res
+end
+
 def offset2stream filepath, offset, type, out, &block
   IO.popen([File.join(DSHELL_DEFCON, 'offset2stream.py'), "#{filepath}.ap", offset.to_s, type, filepath, out], &block)
 end
@@ -64,10 +107,19 @@ get '/download' do
   offset = query['offset']
   type = query['type']
   service = query['service'] || 'all'
-  unless filename && type
+  unless type && (filename || type == 'query')
     return 412
   end
   case type
+  when 'query'
+    # all flows containing the query, as one time-ordered pcap
+    q = escape_query(query['q'] || '')
+    dir = File.join PCAP_DIR, service
+    lines = unix_request(SEARCH_SOCK, "0fa\0#{File.join dir, "\x01"}\0#{File.join dir, "\x7f"}\0#{q}").lines
+    flows = lines[0...-1].map {|line| line.split("\t")[0, 2].join "\t" }
+    content_type 'application/vnd.tcpdump.pcap'
+    attachment "#{service}-query.cap"
+    unix_request FLOW_SOCK, "pcaps\0#{flows.join "\n"}"
   when 'all'
     content_type 'application/vnd.tcpdump.pcap'
     attachment filename
@@ -105,24 +157,19 @@ get '/api/autocomplete' do
   q = query['q'] || ''
   service = query['service'] || 'all'
   res = ''
+  sock = nil
   begin
     Timeout.timeout SEARCH_TIMEOUT do
-      sock = Socket.new Socket::AF_UNIX, Socket::SOCK_STREAM, 0
-      sock.connect Socket.pack_sockaddr_un(SEARCH_SOCK)
+      sock = open_socket SEARCH_SOCK
       sock.write "\0#{File.join PCAP_DIR, service, "\x01"}\0#{File.join PCAP_DIR, service, "\x7f"}\0#{q}"
       sock.close_write
       sug = []
       sock.read.lines.each {|line|
-        filepath, offset, context = line.chomp.split "\t"
-        filepath = filepath.sub(/\.ap$/, '')
+        # filename, offset, suggestion, count, epoch, client port, server port, direction, packet begin, packet end, context
+        _, offset, context, _, _, _, _, _, _, y = line.chomp.split "\t"
         offset = offset.to_i
-        offset2stream filepath, offset, 'loc', '/dev/stdout' do |h|
-          body = h.read
-          if ! body.empty?
-            _, y = body.split.map(&:to_i)
-            sug << context.scan(/(?:\\x(?:..)|[^\\]){,#{[y-offset,context.size].min}}/)[0] if offset < y
-          end
-        end
+        y = y.to_i
+        sug << context.scan(/(?:\\x(?:..)|[^\\]){,#{[y-offset,context.size].min}}/)[0] if offset < y
       }
       res = {query: q, suggestions: sug.uniq }.to_json
       sock.close
@@ -130,6 +177,9 @@ get '/api/autocomplete' do
   rescue => e
     STDERR.puts e.message
     STDERR.puts e.backtrace
+  ensure
+    # hanging up lets indexer cancel the request
+    hang_up sock if sock && ! sock.closed?
   end
   res
 end
@@ -143,42 +193,26 @@ get '/api/search' do
   res = ''
   total = 0
 
-  qq = q.gsub(/\\[0-7]{1,3}/) {|match|
-    "\\x#{'%02x' % match[1..-1].to_i(8)}"
-  }
-  .gsub('\\\\', '\\x5c')
-  .gsub('\\a', '\\x07')
-  .gsub('\\b', '\\x08')
-  .gsub('\\t', '\\x09')
-  .gsub('\\n', '\\x0a')
-  .gsub('\\v', '\\x0b')
-  .gsub('\\f', '\\x0c')
-  .gsub('\\r', '\\x0d')
+  qq = escape_query q
 
+  sock = nil
   begin
     Timeout.timeout SEARCH_TIMEOUT do
-      sock = Socket.new Socket::AF_UNIX, Socket::SOCK_STREAM, 0
-      sock.connect Socket.pack_sockaddr_un(SEARCH_SOCK)
-      sock.write "#{offset}\0#{File.join PCAP_DIR, service, "\x01"}\0#{File.join PCAP_DIR, service, "\x7f"}\0#{qq}"
+      sock = open_socket SEARCH_SOCK
+      sock.write "#{offset}c\0#{File.join PCAP_DIR, service, "\x01"}\0#{File.join PCAP_DIR, service, "\x7f"}\0#{qq}"
       sock.close_write
       lines = sock.read.lines
       sock.close
       total = [lines[-1].to_i, PER_PAGE*MAX_PAGES].min
 
       res = []
-      IO.popen [File.join(DSHELL_DEFCON, 'context.py')], 'r+' do |h|
-        lines[0...-1].each {|line|
-          filepath, offset, len = line.chomp.split "\t"
-          h.puts "#{filepath}\t#{offset}\t#{len}"
-          h.flush
-          line = h.readline
-          _, offset, epoch, port0, port1, context = line.chomp.split "\t"
-          epoch = epoch.to_i
-          if epoch >= 0 && context && ! context.empty?
-            res << {filename: filepath.sub(/.*\/(.*)\.ap$/, '\1'), offset: offset.to_i, epoch: epoch, port0: port0.to_i, port1: port1.to_i, context: context}
-          end
-        }
-      end
+      lines[0...-1].each {|line|
+        filepath, offset, _, epoch, port1, port0, dir, _, _, context = line.chomp.split "\t"
+        epoch = epoch.to_i
+        if epoch >= 0 && context && ! context.empty?
+          res << {filename: filepath.sub(/.*\/(.*)\.ap$/, '\1'), offset: offset.to_i, epoch: epoch, port0: port0.to_i, port1: port1.to_i, dir: dir, context: context}
+        end
+      }
 
       res_grouped = Hash.new {|h,k| h[k] = [] }
       res.each {|x|
@@ -198,5 +232,7 @@ get '/api/search' do
     STDERR.puts e.backtrace
   else
     res
+  ensure
+    hang_up sock if sock && ! sock.closed?
   end
 end